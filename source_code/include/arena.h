@@ -0,0 +1,34 @@
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Per-process arena. The PCB of a process, its segment and page tables
+ * and its code are carved out of chunks taken from a pool shared by all
+ * arenas, and all of them go back to the pool at once when the last
+ * reference to the arena is dropped.
+ *
+ * An arena is not locked: blocks of a process are allocated and freed
+ * either before it is published or by the CPU running it. */
+struct arena_t;
+
+/* Create an empty arena holding one reference */
+struct arena_t * new_arena(void);
+
+/* Return a zero-filled block of [size] bytes from [arena] */
+void * arena_alloc(struct arena_t * arena, size_t size);
+
+/* Give block [ptr] of [size] bytes back to [arena] for reuse by a later
+ * arena_alloc() of the same size */
+void arena_free(struct arena_t * arena, void * ptr, size_t size);
+
+void get_arena(struct arena_t * arena);
+
+/* Drop a reference to [arena], releasing it with the last one */
+void put_arena(struct arena_t * arena);
+
+void arena_stats(void);
+
+#endif
+
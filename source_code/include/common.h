@@ -5,12 +5,24 @@
 
 #include <stdint.h>
 
-#define ADDRESS_SIZE	20
-#define OFFSET_LEN	10
-#define SEGMENT_LEN	5
-#define PAGE_LEN	5
+/* Geometry of memory. By default, addresses have 20 bits: a 5-bit segment
+ * index, a 5-bit page index and a 10-bit offset, and RAM is 1 MiB. It can
+ * be changed with set_geometry() before memory is initialized. */
+struct geometry_t {
+	int offset_len;
+	int segment_len;
+	int page_len;
+	int num_pages;	// Physical pages in RAM
+};
+
+extern struct geometry_t _geometry;
 
-#define NUM_PAGES	(1 << (ADDRESS_SIZE - OFFSET_LEN))
+#define OFFSET_LEN	(_geometry.offset_len)
+#define SEGMENT_LEN	(_geometry.segment_len)
+#define PAGE_LEN	(_geometry.page_len)
+#define ADDRESS_SIZE	(SEGMENT_LEN + PAGE_LEN + OFFSET_LEN)
+
+#define NUM_PAGES	(_geometry.num_pages)
 #define PAGE_SIZE	(1 << OFFSET_LEN)
 
 typedef char BYTE;
@@ -21,7 +33,12 @@ enum ins_opcode_t {
 	ALLOC,	// Allocate memory
 	FREE,	// Deallocated a memory block
 	READ,	// Write data to a byte on memory
-	WRITE	// Read data from a byte on memory
+	WRITE,	// Read data from a byte on memory
+	FILL,	// Set every byte of a memory region to the same value
+	COPY,	// Copy a memory region to another one
+	FORK,	// Clone the process, sharing its memory copy-on-write
+	SHMGET,	// Get the ID of a shared memory segment
+	SHMAT	// Map a shared memory segment
 };
 
 /* instructions executed by the CPU */
@@ -35,27 +52,46 @@ struct inst_t {
 struct code_seg_t {
 	struct inst_t * text;
 	uint32_t size;
+	int refs;	// Processes running this code
+	struct arena_t * arena;	// Arena the code is carved from
 };
 
 struct page_table_t {
-	/* A row in the page table of the second layer */
-	struct  {
-		addr_t v_index; // The index of virtual address
+	int size;	// Number of valid rows
+	/* A row in the page table of the second layer, indexed directly by
+	 * the page index of the virtual address */
+	struct pte_t {
 		addr_t p_index; // The index of physical address
-	} table[1 << SEGMENT_LEN];
-	int size;
+		int valid;	// The page belongs to an allocated region
+		int present;	// The page is in physical page [p_index]
+		int head;	// The page is the first one of its region
+		int swap;	// Slot of the page in the swap area plus one,
+				// 0 if the page is not swapped out
+	} table[];	// 1 << PAGE_LEN rows
 };
 
 /* Mapping virtual addresses and physical ones */
 struct seg_table_t {
-	/* Translation table for the first layer */
-	struct {
-		addr_t v_index;	// Virtual index
-		struct page_table_t * pages;
-	} table[1 << PAGE_LEN];
-	int size;	// Number of row in the first layer
+	int size;	// Number of used segments
+	/* Translation table for the first layer, indexed directly by the
+	 * segment index of the virtual address */
+	struct seg_entry_t {
+		struct page_table_t * pages;	// NULL if the segment is unused
+						// or mapped by a large page
+		/* A large page maps the whole segment to contiguous frames
+		 * starting at [p_index], with no page table */
+		int large;
+		addr_t p_index;
+		int head;	// The first page is the head of a region
+	} table[];	// 1 << SEGMENT_LEN rows
 };
 
+/* Bytes taken by the tables, which depend on the geometry */
+#define PAGE_TABLE_SIZE	(sizeof(struct page_table_t) + \
+	(1 << PAGE_LEN) * sizeof(struct pte_t))
+#define SEG_TABLE_SIZE	(sizeof(struct seg_table_t) + \
+	(1 << SEGMENT_LEN) * sizeof(struct seg_entry_t))
+
 /* PCB, describe information about a process */
 struct pcb_t {
 	uint32_t pid;	// PID
@@ -65,6 +101,12 @@ struct pcb_t {
 	uint32_t pc; // Program pointer, point to the next instruction
 	struct seg_table_t * seg_table; // Page table
 	uint32_t bp;	// Break pointer
+	struct pcb_t * next;	// Next process in the same priority level list
+	int cpu;	// CPU the process last ran on, -1 if it has never run
+	uint32_t map_gen;	// Bumped whenever memory of the process is unmapped
+	struct arena_t * arena;	// Holds the PCB and its tables
+	struct region_t * regions;	// Mapped memory regions, see mem.c
+	struct hole_t * holes;	// Free virtual ranges below bp, see mem.c
 };
 
 #endif
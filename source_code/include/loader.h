@@ -5,5 +5,14 @@
 
 struct pcb_t * load(const char * path);
 
+/* Create a copy of [parent] with a new PID, running the same code and
+ * sharing its memory copy-on-write. Return NULL if the memory cannot be
+ * shared (see fork_mem()). */
+struct pcb_t * clone_proc(struct pcb_t * parent);
+
+/* Release the memory of finished process [proc], then its PCB, tables
+ * and, once no other process runs it, its code */
+void free_proc(struct pcb_t * proc);
+
 #endif
 
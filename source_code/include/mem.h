@@ -2,11 +2,26 @@
 #define MEM_H
 
 #include "common.h"
+#include <stddef.h>
 
-#define RAM_SIZE	(1 << ADDRESS_SIZE)
+#define RAM_SIZE	((size_t)NUM_PAGES * PAGE_SIZE)
+
+/* Flags of init_mem() */
+#define MEM_BUDDY	0x1	// Allocate contiguous runs with a buddy system
+#define MEM_DEMAND	0x2	// Demand paging with a swap area, evicting
+				// pages with the clock algorithm
+#define MEM_AGING	0x4	// With MEM_DEMAND, evict pages by aging
+
+/* Use [ram_size] bytes of RAM and split virtual addresses into
+ * [segment_len], [page_len] and [offset_len] bits. Must be called before
+ * init_mem(). Return 0 on success, or 1 if the geometry is not supported:
+ * addresses are at most 31 bits, pages at least 16 bytes and RAM at most
+ * 2 GiB, in whole pages. */
+int set_geometry(uint64_t ram_size, int segment_len, int page_len,
+		int offset_len);
 
 /* Init related parameters, must be called before being used */
-void init_mem(void);
+void init_mem(int flags);
 
 /* Allocate [size] bytes for process [proc] and return its virtual address.
  * If we cannot allocate new memory region for this process, return 0 */
@@ -16,6 +31,10 @@ addr_t alloc_mem(uint32_t size, struct pcb_t * proc);
  * process [proc]. Return 0 if [address] is valid. Otherwise, return 1 */
 int free_mem(addr_t address, struct pcb_t * proc);
 
+/* Free every memory block of process [proc], which has finished, in
+ * time proportional to the pages it maps */
+void release_mem(struct pcb_t * proc);
+
 /* Read 1 byte memory pointed by [address] used by process [proc] and
  * save it to [data].
  * If the given [address] is valid, return 0. Otherwise, return 1 */
@@ -25,8 +44,58 @@ int read_mem(addr_t address, struct pcb_t * proc, BYTE * data);
  * [proc]. If given [address] is valid, return 0. Otherwise, return 1 */
 int write_mem(addr_t address, struct pcb_t * proc, BYTE data);
 
+/* Set [size] bytes starting at [address] of process [proc] to [data].
+ * If the whole region is valid, return 0. Otherwise, return 1 and leave
+ * the memory untouched. With [size] 0, [address] must still be valid. */
+int fill_mem(addr_t address, struct pcb_t * proc, BYTE data, uint32_t size);
+
+/* Copy [size] bytes from [source] to [destination] of process [proc],
+ * regions may overlap. If both regions are valid, return 0. Otherwise,
+ * return 1 and leave the memory untouched. With [size] 0, both addresses
+ * must still be valid. */
+int copy_mem(addr_t source, addr_t destination, struct pcb_t * proc,
+		uint32_t size);
+
+/* Find shared memory segment [key], or create it with [size] bytes if
+ * there is none. Return the ID of the segment, or -1 if it exists but is
+ * smaller than [size] or there is no room for a new one. */
+int get_shm(uint32_t key, uint32_t size);
+
+/* Map shared memory segment [id] into process [proc] and return its
+ * virtual address, or 0 if it cannot be mapped. free_mem() at this
+ * address detaches the segment. The segment keeps its content as long
+ * as some process is attached to it, and is removed when the last one
+ * detaches. */
+addr_t attach_shm(int id, struct pcb_t * proc);
+
+/* Give [child], a copy of [parent] with empty tables, the memory of
+ * [parent]. Frames are shared until either process writes to them, and
+ * such a write fails if no frame is left for the copy. With demand
+ * paging the child gets a copy in swap instead. Either way, the child is
+ * attached to the shared memory segments of [parent]. Return 0 on success, or
+ * 1 if there is not enough swap for it. */
+int fork_mem(struct pcb_t * parent, struct pcb_t * child);
+
+/* Move at most [max_pages] pages in use to free frames lower in memory,
+ * so that free frames gather in a single run at the top. A pass over
+ * memory starts once frames have been freed since the last one and goes
+ * on over later calls. Only pages mapped by a page table of a single
+ * process move. Return the number of pages moved, always 0 with the
+ * buddy system. */
+int compact_mem(int max_pages);
+
 void dump(void);
 
+/* Give each of [num_cpus] CPUs its own TLB and frame magazine. Until this
+ * is called every process shares a single TLB and memory is only
+ * allocated under the global memory lock. */
+void init_tlb(int num_cpus);
+
+/* Print TLB hit, miss and flush counts, how fragmented free physical
+ * memory is, memory lock and magazine counts and, with demand paging,
+ * page fault counts */
+void mem_stats(void);
+
 #endif
 
 
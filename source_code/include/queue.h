@@ -4,18 +4,75 @@
 
 #include "common.h"
 
-#define MAX_QUEUE_SIZE 10
+struct queue_node_t {
+	struct pcb_t * proc;
+	uint64_t seq;	// Enqueue order, keep FIFO among equal priorities
+};
+
+#define MAX_PRIO	140	// Priority levels of a priority array
+#define PRIO_WORDS	((MAX_PRIO + 63) / 64)
 
+/* Binary max-heap of processes keyed on priority. The heap grows on
+ * demand so a process is never dropped. A zero-filled queue is an empty
+ * heap.
+ *
+ * A queue set up by init_prio_array() keeps one FIFO list per priority
+ * level and a bitmap of the non-empty levels instead, so the highest
+ * priority process is found with a find-first-set in constant time.
+ * Priorities above MAX_PRIO - 1 share the top level. */
 struct queue_t {
-	struct pcb_t * proc[MAX_QUEUE_SIZE];
+	struct queue_node_t * heap;
 	int size;
+	int capacity;
+	uint64_t seq;	// Sequence number of the next enqueued process
+
+	int prio_array;
+	uint64_t bitmap[PRIO_WORDS];	// Bit i is set if level i is not empty
+	struct pcb_t * head[MAX_PRIO];
+	struct pcb_t * tail[MAX_PRIO];
 };
 
+void init_prio_array(struct queue_t * q);
+
 void enqueue(struct queue_t * q, struct pcb_t * proc);
 
 struct pcb_t * dequeue(struct queue_t * q);
 
 int empty(struct queue_t * q);
 
+#define MAX_AFFINITY_WINDOW	16
+
+/* Same as dequeue() but among the first [window] processes sharing the
+ * highest priority, prefer the oldest one which last ran on [cpu] */
+struct pcb_t * dequeue_affine(struct queue_t * q, int cpu, int window);
+
+/* Bounded lock-free multi-producer/multi-consumer FIFO of processes. Every
+ * cell carries a sequence number telling whether it is ready to be filled
+ * or drained in the current lap, so producers and consumers only race on
+ * [tail] and [head] respectively. */
+struct ring_cell_t {
+	uint64_t seq;
+	struct pcb_t * proc;
+};
+
+struct ring_t {
+	struct ring_cell_t * cells;
+	uint64_t mask;	// Capacity - 1, the capacity is a power of two
+	uint64_t head __attribute__((aligned(64)));	// Next cell to drain
+	uint64_t tail __attribute__((aligned(64)));	// Next cell to fill
+	unsigned long retries;	// Lost races on [head] or [tail]
+};
+
+/* Init [r] to hold at least [capacity] processes */
+void init_ring(struct ring_t * r, int capacity);
+
+void free_ring(struct ring_t * r);
+
+/* Append [proc] to [r]. Return 0 on success or 1 if [r] is full */
+int ring_enqueue(struct ring_t * r, struct pcb_t * proc);
+
+/* Remove the oldest process of [r]. Return NULL if [r] is empty */
+struct pcb_t * ring_dequeue(struct ring_t * r);
+
 #endif
 
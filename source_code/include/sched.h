@@ -1,22 +1,32 @@
-#ifndef QUEUE_H
-#define QUEUE_H
+
+#ifndef SCHED_H
+#define SCHED_H
 
 #include "common.h"
 
+/* Scheduling policy flags */
+#define POLICY_PERCPU	0x1	// One ready/run queue pair per CPU
+#define POLICY_O1	0x2	// Bitmap priority arrays instead of heaps
+#define POLICY_RR	0x4	// Lock-free round robin, priorities are ignored
+#define POLICY_AFFINE	0x8	// Prefer processes which last ran on the CPU
+
 int queue_empty(void);
 
-void init_scheduler(void);
+/* Init scheduler for [num_cpus] CPUs using [policy] */
+void init_scheduler(int policy, int num_cpus);
 void finish_scheduler(void);
 
-/* Get the next process from ready queue */
-struct pcb_t * get_proc(void);
+/* Get the next process for CPU [cpu] from ready queue */
+struct pcb_t * get_proc(int cpu);
 
-/* Put a process back to run queue */
-void put_proc(struct pcb_t * proc);
+/* Put a process which has just run on CPU [cpu] back to run queue */
+void put_proc(struct pcb_t * proc, int cpu);
 
 /* Add a new process to ready queue */
 void add_proc(struct pcb_t * proc);
 
-#endif
+/* Print scheduler statistics */
+void sched_stats(void);
 
+#endif
 
@@ -5,12 +5,8 @@
 #include <stdint.h>
 
 struct timer_id_t {
-	int done;
-	int fsh;
-	pthread_cond_t event_cond;
-	pthread_mutex_t event_lock;
-	pthread_cond_t timer_cond;
-	pthread_mutex_t timer_lock;
+	int done;	// Device has finished its job in the current slot
+	int fsh;	// Device has been detached from the timer
 };
 
 void start_timer();
@@ -23,6 +19,25 @@ void detach_event(struct timer_id_t * event);
 
 void next_slot(struct timer_id_t* timer_id);
 
+/* Wake-up slot of a device that waits for other devices to give it work */
+#define IDLE_FOREVER	UINT64_MAX
+
+/* Same as next_slot() but also tell the timer the device has nothing to do
+ * until slot [wake]. If fast-forward is enabled and every device is idle,
+ * the timer jumps straight to the earliest wake-up slot. */
+void idle_slot(struct timer_id_t * timer_id, uint64_t wake);
+
+/* Enable/disable fast-forward over idle slots, must be called before
+ * start_timer() */
+void set_fast_forward(int enable);
+
 uint64_t current_time();
 
+/* Drive the clock from the caller's thread instead of start_timer(), for
+ * engines which run every device by themselves. begin_slot() announces the
+ * current slot and end_slot() moves to slot [next]. */
+void begin_slot(void);
+
+void end_slot(uint64_t next);
+
 #endif
@@ -0,0 +1,180 @@
+
+#include "arena.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK	(2 << 10)	// Size of a pooled chunk
+#define ARENA_ALIGN	16
+#define ARENA_CLASSES	4	// Block sizes an arena keeps free lists for
+
+#define ALIGN(x)	(((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* Header of a chunk, blocks follow it. Blocks too large for a pooled
+ * chunk get a chunk of their own which goes back to the heap. */
+struct chunk_t {
+	struct chunk_t * next;
+	size_t size;	// Bytes after the header
+} __attribute__((aligned(ARENA_ALIGN)));
+
+struct free_block_t {
+	struct free_block_t * next;
+};
+
+/* Lives at the start of the chunk the arena was created with, which
+ * stays the last one of [chunks] */
+struct arena_t {
+	int refs;
+	struct chunk_t * chunks;	// Chunks of the arena, the one blocks
+					// are carved from first
+	size_t used;	// Bytes carved from the first chunk
+	struct {
+		size_t size;	// 0 if the class is unused
+		struct free_block_t * head;
+	} free[ARENA_CLASSES];
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct chunk_t * _pool;	// Free pooled chunks
+
+static unsigned long _nr_arenas;
+static unsigned long _nr_blocks;
+static unsigned long _nr_heap;	// Chunks taken from the heap
+static unsigned long _nr_reused;	// Chunks taken from the pool
+static int _chunks_used;
+static int _chunks_peak;
+
+/* Take a chunk for at least [size] bytes of blocks */
+static struct chunk_t * get_chunk(size_t size) {
+	struct chunk_t * chunk = NULL;
+	pthread_mutex_lock(&pool_lock);
+	if (size <= ARENA_CHUNK && _pool != NULL) {
+		chunk = _pool;
+		_pool = chunk->next;
+		_nr_reused++;
+	}else{
+		_nr_heap++;
+	}
+	if (++_chunks_used > _chunks_peak) {
+		_chunks_peak = _chunks_used;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	if (chunk == NULL) {
+		if (size < ARENA_CHUNK) {
+			size = ARENA_CHUNK;
+		}
+		chunk = (struct chunk_t *)malloc(sizeof(struct chunk_t) + size);
+		if (chunk == NULL) {
+			printf("Out of memory for process metadata\n");
+			exit(1);
+		}
+		chunk->size = size;
+	}
+	return chunk;
+}
+
+struct arena_t * new_arena(void) {
+	struct chunk_t * chunk = get_chunk(ARENA_CHUNK);
+	struct arena_t * arena = (struct arena_t *)(chunk + 1);
+	memset(arena, 0, sizeof(struct arena_t));
+	arena->refs = 1;
+	arena->chunks = chunk;
+	chunk->next = NULL;
+	arena->used = ALIGN(sizeof(struct arena_t));
+	__atomic_add_fetch(&_nr_arenas, 1, __ATOMIC_RELAXED);
+	return arena;
+}
+
+void * arena_alloc(struct arena_t * arena, size_t size) {
+	void * block;
+	int i;
+	size = ALIGN(size);
+	__atomic_add_fetch(&_nr_blocks, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < ARENA_CLASSES; i++) {
+		if (arena->free[i].size == size && arena->free[i].head != NULL) {
+			block = arena->free[i].head;
+			arena->free[i].head = arena->free[i].head->next;
+			memset(block, 0, size);
+			return block;
+		}
+	}
+	if (size > ARENA_CHUNK) {
+		/* A dedicated chunk, linked behind the current one so that
+		 * small blocks keep being carved from the current one */
+		struct chunk_t * chunk = get_chunk(size);
+		chunk->next = arena->chunks->next;
+		arena->chunks->next = chunk;
+		block = chunk + 1;
+	}else{
+		if (arena->used + size > arena->chunks->size) {
+			struct chunk_t * chunk = get_chunk(ARENA_CHUNK);
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+			arena->used = 0;
+		}
+		block = (char *)(arena->chunks + 1) + arena->used;
+		arena->used += size;
+	}
+	memset(block, 0, size);
+	return block;
+}
+
+void arena_free(struct arena_t * arena, void * ptr, size_t size) {
+	int i;
+	size = ALIGN(size);
+	for (i = 0; i < ARENA_CLASSES; i++) {
+		if (arena->free[i].size == size || arena->free[i].size == 0) {
+			struct free_block_t * block = (struct free_block_t *)ptr;
+			arena->free[i].size = size;
+			block->next = arena->free[i].head;
+			arena->free[i].head = block;
+			return;
+		}
+	}
+	/* Out of classes, the block waits for the arena to be released */
+}
+
+void get_arena(struct arena_t * arena) {
+	__atomic_add_fetch(&arena->refs, 1, __ATOMIC_RELAXED);
+}
+
+void put_arena(struct arena_t * arena) {
+	if (__atomic_sub_fetch(&arena->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	/* The arena lives in the last chunk of the list, which is freed
+	 * last, so read the head of the list first */
+	struct chunk_t * chunk = arena->chunks;
+	struct chunk_t * pooled = NULL;
+	int n = 0;
+	while (chunk != NULL) {
+		struct chunk_t * next = chunk->next;
+		if (chunk->size == ARENA_CHUNK) {
+			chunk->next = pooled;
+			pooled = chunk;
+		}else{
+			free(chunk);
+		}
+		chunk = next;
+		n++;
+	}
+	pthread_mutex_lock(&pool_lock);
+	while (pooled != NULL) {
+		struct chunk_t * next = pooled->next;
+		pooled->next = _pool;
+		_pool = pooled;
+		pooled = next;
+	}
+	_chunks_used -= n;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void arena_stats(void) {
+	printf("Arenas: %lu, blocks: %lu, heap allocations: %lu "
+		"(chunks reused: %lu)\n",
+		_nr_arenas, _nr_blocks, _nr_heap, _nr_reused);
+	printf("Arena chunks in use: %d, peak: %d\n",
+		_chunks_used, _chunks_peak);
+}
+
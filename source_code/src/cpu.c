@@ -1,6 +1,8 @@
 
 #include "cpu.h"
 #include "mem.h"
+#include "loader.h"
+#include "sched.h"
 
 static int calc(struct pcb_t * proc) {
 	return ((unsigned long)proc & 0UL);
@@ -44,6 +46,63 @@ static int write(
 	return write_mem(proc->regs[destination] + offset, proc, data);
 } 
 
+static int fill(
+		struct pcb_t * proc, // Process executing the instruction
+		BYTE data, // Data to be written into every byte of the region
+		uint32_t destination, // Index of register holding the region
+		uint32_t size) { // Size of the region
+	return fill_mem(proc->regs[destination], proc, data, size);
+}
+
+static int copy(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t source, // Index of register holding the source
+		uint32_t destination, // Index of register holding the destination
+		uint32_t size) { // Number of bytes to be copied
+	return copy_mem(proc->regs[source], proc->regs[destination], proc, size);
+}
+
+static int fork_proc(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t reg_index) { // Register receiving the child PID in
+				      // the parent and 0 in the child
+	struct pcb_t * child = clone_proc(proc);
+	if (child == NULL) {
+		return 1;
+	}
+	proc->regs[reg_index] = child->pid;
+	child->regs[reg_index] = 0;
+	add_proc(child);
+	return 0;
+}
+
+static int shmget(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t key, // Key of the segment
+		uint32_t size, // Size of the segment if it is created
+		uint32_t reg_index) { // Register receiving the segment ID
+	int id = get_shm(key, size);
+	if (id < 0) {
+		return 1;
+	}else{
+		proc->regs[reg_index] = id;
+		return 0;
+	}
+}
+
+static int shmat(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t id_index, // Register holding the segment ID
+		uint32_t reg_index) { // Register receiving the address
+	addr_t addr = attach_shm(proc->regs[id_index], proc);
+	if (addr == 0) {
+		return 1;
+	}else{
+		proc->regs[reg_index] = addr;
+		return 0;
+	}
+}
+
 int run(struct pcb_t * proc) {
 	/* Check if Program Counter point to the proper instruction */
 	if (proc->pc >= proc->code->size) {
@@ -69,6 +128,21 @@ int run(struct pcb_t * proc) {
 	case WRITE:
 		stat = write(proc, ins.arg_0, ins.arg_1, ins.arg_2);
 		break;
+	case FILL:
+		stat = fill(proc, ins.arg_0, ins.arg_1, ins.arg_2);
+		break;
+	case COPY:
+		stat = copy(proc, ins.arg_0, ins.arg_1, ins.arg_2);
+		break;
+	case FORK:
+		stat = fork_proc(proc, ins.arg_0);
+		break;
+	case SHMGET:
+		stat = shmget(proc, ins.arg_0, ins.arg_1, ins.arg_2);
+		break;
+	case SHMAT:
+		stat = shmat(proc, ins.arg_0, ins.arg_1);
+		break;
 	default:
 		stat = 1;
 	}
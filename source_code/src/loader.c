@@ -1,5 +1,7 @@
 
 #include "loader.h"
+#include "mem.h"
+#include "arena.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +13,11 @@ static uint32_t avail_pid = 1;
 #define OPT_FREE	"free"
 #define OPT_READ	"read"
 #define OPT_WRITE	"write"
+#define OPT_FILL	"fill"
+#define OPT_COPY	"copy"
+#define OPT_FORK	"fork"
+#define OPT_SHMGET	"shmget"
+#define OPT_SHMAT	"shmat"
 
 static enum ins_opcode_t get_opcode(char * opt) {
 	if (!strcmp(opt, OPT_CALC)) {
@@ -23,6 +30,16 @@ static enum ins_opcode_t get_opcode(char * opt) {
 		return READ;
 	}else if (!strcmp(opt, OPT_WRITE)) {
 		return WRITE;
+	}else if (!strcmp(opt, OPT_FILL)) {
+		return FILL;
+	}else if (!strcmp(opt, OPT_COPY)) {
+		return COPY;
+	}else if (!strcmp(opt, OPT_FORK)) {
+		return FORK;
+	}else if (!strcmp(opt, OPT_SHMGET)) {
+		return SHMGET;
+	}else if (!strcmp(opt, OPT_SHMAT)) {
+		return SHMAT;
 	}else{
 		printf("Opcode: %s\n", opt);
 		exit(1);
@@ -31,13 +48,18 @@ static enum ins_opcode_t get_opcode(char * opt) {
 
 struct pcb_t * load(const char * path) {
 	/* Create new PCB for the new process */
-	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
-	proc->pid = avail_pid;
-	avail_pid++;
+	struct arena_t * arena = new_arena();
+	struct pcb_t * proc =
+		(struct pcb_t * )arena_alloc(arena, sizeof(struct pcb_t));
+	proc->arena = arena;
+	proc->pid = __atomic_fetch_add(&avail_pid, 1, __ATOMIC_RELAXED);
 	proc->seg_table =
-		(struct seg_table_t*)malloc(sizeof(struct seg_table_t));
+		(struct seg_table_t*)arena_alloc(arena, SEG_TABLE_SIZE);
 	proc->bp = PAGE_SIZE;
 	proc->pc = 0;
+	proc->next = NULL;
+	proc->cpu = -1;
+	proc->map_gen = 0;
 
 	/* Read process code from file */
 	FILE * file;
@@ -46,10 +68,15 @@ struct pcb_t * load(const char * path) {
 		exit(1);		
 	}
 	char opcode[10];
-	proc->code = (struct code_seg_t*)malloc(sizeof(struct code_seg_t));
+	proc->code = (struct code_seg_t*)
+		arena_alloc(arena, sizeof(struct code_seg_t));
 	fscanf(file, "%u %u", &proc->priority, &proc->code->size);
-	proc->code->text = (struct inst_t*)malloc(
-		sizeof(struct inst_t) * proc->code->size
+	/* Forked processes run the code too, so it keeps the arena */
+	proc->code->refs = 1;
+	proc->code->arena = arena;
+	get_arena(arena);
+	proc->code->text = (struct inst_t*)arena_alloc(
+		arena, sizeof(struct inst_t) * proc->code->size
 	);
 	uint32_t i = 0;
 	for (i = 0; i < proc->code->size; i++) {
@@ -59,6 +86,7 @@ struct pcb_t * load(const char * path) {
 		case CALC:
 			break;
 		case ALLOC:
+		case SHMAT:
 			fscanf(
 				file,
 				"%u %u\n",
@@ -67,10 +95,14 @@ struct pcb_t * load(const char * path) {
 			);
 			break;
 		case FREE:
+		case FORK:
 			fscanf(file, "%u\n", &proc->code->text[i].arg_0);
 			break;
 		case READ:
 		case WRITE:
+		case FILL:
+		case COPY:
+		case SHMGET:
 			fscanf(
 				file,
 				"%u %u %u\n",
@@ -84,8 +116,41 @@ struct pcb_t * load(const char * path) {
 			exit(1);
 		}
 	}
+	fclose(file);
 	return proc;
 }
 
+struct pcb_t * clone_proc(struct pcb_t * parent) {
+	struct arena_t * arena = new_arena();
+	struct pcb_t * proc =
+		(struct pcb_t * )arena_alloc(arena, sizeof(struct pcb_t));
+	*proc = *parent;
+	proc->arena = arena;
+	proc->seg_table =
+		(struct seg_table_t*)arena_alloc(arena, SEG_TABLE_SIZE);
+	proc->next = NULL;
+	proc->cpu = -1;
+	proc->map_gen = 0;
+	proc->regions = NULL;
+	proc->holes = NULL;
+	/* CPUs fork while the loader loads */
+	proc->pid = __atomic_fetch_add(&avail_pid, 1, __ATOMIC_RELAXED);
+	if (fork_mem(parent, proc)) {
+		put_arena(arena);
+		return NULL;
+	}
+	__atomic_add_fetch(&proc->code->refs, 1, __ATOMIC_RELAXED);
+	return proc;
+}
+
+void free_proc(struct pcb_t * proc) {
+	struct code_seg_t * code = proc->code;
+	release_mem(proc);
+	if (__atomic_sub_fetch(&code->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		put_arena(code->arena);
+	}
+	put_arena(proc->arena);
+}
+
 
 
@@ -1,26 +1,554 @@
 
 #include "mem.h"
+#include "arena.h"
 #include "stdlib.h"
 #include "string.h"
 #include <pthread.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
-static BYTE _ram[RAM_SIZE];
+struct geometry_t _geometry = {
+	.offset_len = 10,
+	.segment_len = 5,
+	.page_len = 5,
+	.num_pages = 1 << 10,
+};
 
-static struct {
+/* RAM is an anonymous mapping, so pages of it which are never used are
+ * never backed by host memory */
+static BYTE * _ram;
+
+static struct mem_stat_t {
 	uint32_t proc;	// ID of process currently uses this page
 	int index;	// Index of the page in the list of pages allocated
 			// to the process.
 	int next;	// The next page in the list. -1 if it is the last
 			// page.
-} _mem_stat [NUM_PAGES]; //check status of physical page
+	int refs;	// Page tables mapping this page, more than one if
+			// it is shared copy-on-write or shared memory
+	int shm;	// Shared memory segment of this page plus one, 0 if
+			// the page is private
+	struct pcb_t * owner;	// The only process mapping this page and the
+	addr_t page;		// virtual page it backs. NULL if the page is
+				// shared or free.
+	uintptr_t sharers;	// XOR of the PCBs sharing the page copy-on-write,
+				// all at virtual page [page]
+} * _mem_stat; //check status of physical page, NUM_PAGES rows
+
+/* Bit i of the frame map is set if physical page i is in use. Bits past
+ * the last page are set too so that they are never claimed. */
+#define MAP_WORDS	((NUM_PAGES + 63) / 64)
+
+static uint64_t * _frame_map;
+static int _used_frames;	// Number of bits set in _frame_map
+static int _first_free_word;	// No free frame below this word
+
+/* Copy-on-write. Forking only shares frames, so a write to a shared
+ * frame fails like an invalid write if no frame is left for the copy. */
+static unsigned long _nr_forks;
+static unsigned long _nr_cow_faults;
+
+/* Large pages. A whole segment of one region in contiguous frames is
+ * mapped by its segment table row alone. It is split into a page table
+ * when one of its pages has to be mapped on its own, e.g. on a
+ * copy-on-write fault. Demand paging maps single pages only. */
+static unsigned long _nr_large;
+static unsigned long _nr_splits;
+
+/* Compaction, see compact_mem(). A pass moves pages from the top of RAM
+ * down to free frames at the bottom, a few per call, until the scan for
+ * free frames going up meets the scan for pages going down. Free frames
+ * then make a single run at the top. */
+static int _compacting;	// A pass is going on, read atomically
+static int _free_scan;	// No free frame below it in the pass
+static int _move_scan;	// No page to move above it in the pass
+static unsigned long _nr_freed;	// Frames freed, changed atomically
+static unsigned long _freed_mark;	// [_nr_freed] when the pass started
+static unsigned long _nr_passes;
+static unsigned long _nr_moved;
+
+/* Shared memory segments. A segment gets its frames when it is first
+ * attached and gives them back once no process maps them any more.
+ * Its frames are written in place by every process and never swapped
+ * out. */
+#define MAX_SHM	64
+
+static struct shm_t {
+	uint32_t key;
+	int num_pages;	// 0 if the slot is unused
+	int first;	// First frame, the others follow [next] in _mem_stat.
+			// -1 if the segment has no frames.
+	int nr_frames;	// Frames still mapped by some process
+	uint32_t * pids;	// Processes attached to the segment
+	int nr_attached;
+} _shm[MAX_SHM];
+static int _shm_frames;	// Frames of every segment
+
+/* Return 1 if frame [i] must be copied before it is written */
+static int cow_frame(int i) {
+	return __atomic_load_n(&_mem_stat[i].refs, __ATOMIC_ACQUIRE) > 1 &&
+		!_mem_stat[i].shm;
+}
+
+/* Share frame [i], private or already shared copy-on-write, with [child]
+ * too. Caller holds [mem_lock]. */
+static void share_frame(int i, struct pcb_t * child) {
+	if (_mem_stat[i].owner != NULL) {
+		_mem_stat[i].sharers = (uintptr_t)_mem_stat[i].owner;
+		_mem_stat[i].owner = NULL;
+	}
+	_mem_stat[i].sharers ^= (uintptr_t)child;
+	_mem_stat[i].refs++;
+}
+
+/* [proc] is about to drop its reference to copy-on-write frame [i]. The
+ * sharer left alone, if any, owns the frame again. Caller holds
+ * [mem_lock]. */
+static void leave_frame(int i, struct pcb_t * proc) {
+	_mem_stat[i].sharers ^= (uintptr_t)proc;
+	if (_mem_stat[i].refs == 2) {
+		struct pcb_t * owner = (struct pcb_t *)_mem_stat[i].sharers;
+		_mem_stat[i].owner = owner;
+		_mem_stat[i].proc = owner->pid;
+		_mem_stat[i].sharers = 0;
+	}
+}
 
 static pthread_mutex_t mem_lock;
 
-void init_mem(void) {
-	memset(_mem_stat, 0, sizeof(*_mem_stat) * NUM_PAGES);
-	memset(_ram, 0, sizeof(BYTE) * RAM_SIZE);
+/* Acquisitions of [mem_lock], those which had to wait, and the time it
+ * was held. Only changed with the lock held. */
+static unsigned long _nr_mem_locks;
+static unsigned long _nr_mem_contended;
+static uint64_t _mem_lock_ns;
+static uint64_t _mem_lock_since;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void lock_mem(void) {
+	int contended = 0;
+	if (pthread_mutex_trylock(&mem_lock) != 0) {
+		pthread_mutex_lock(&mem_lock);
+		contended = 1;
+	}
+	_nr_mem_locks++;
+	_nr_mem_contended += contended;
+	_mem_lock_since = now_ns();
+}
+
+static void unlock_mem(void) {
+	_mem_lock_ns += now_ns() - _mem_lock_since;
+	pthread_mutex_unlock(&mem_lock);
+}
+
+/* Per-CPU frame magazines, used without demand paging and the buddy
+ * system. A CPU keeps a few free frames of its own: small allocations of
+ * the process it runs take frames from its magazine and frees of private
+ * frames put them back, under the lock of the magazine only, which they
+ * hold while they change the tables of the process. Magazines
+ * are refilled from and drained to the frame map a batch at a time under
+ * [mem_lock], and when the frame map runs short the frames of idle
+ * magazines are taken back. A frame in a magazine is used in the frame
+ * map but free in _mem_stat. While a compaction pass is going on,
+ * allocations and frees bypass magazines and take [mem_lock], and
+ * magazines are not refilled.
+ *
+ * Lock order is magazine, then [mem_lock]. Holding [mem_lock], only try
+ * magazine locks. */
+#define MAG_SIZE	64
+#define MAG_BATCH	16	// Also the largest allocation served
+
+static struct magazine_t {
+	pthread_mutex_t lock;
+	int nr;
+	int frames[MAG_SIZE];
+	struct pcb_t * user;	// Process changing its tables through the
+				// magazine, read atomically
+	unsigned long nr_allocs;
+	unsigned long nr_frees;
+	unsigned long nr_refills;
+	unsigned long nr_drains;
+} __attribute__((aligned(64))) * _mag;
+static int _nr_mag;
+static int _cached_frames;	// Frames in magazines, changed atomically
+
+/* Byte accesses do not take [mem_lock]. A write holds the lock of the
+ * frame it touches, which anyone moving the frame's content must hold
+ * too. A read takes no lock at all: it samples the mapping generation of
+ * the process before translating and retries if the generation changed
+ * by the time the byte has been read. Locks are striped over frames. */
+#define FRAME_LOCKS	64
+
+static pthread_mutex_t frame_lock[FRAME_LOCKS] = {
+	[0 ... FRAME_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_mutex_t * get_frame_lock(addr_t physical_addr) {
+	return &frame_lock[(physical_addr >> OFFSET_LEN) % FRAME_LOCKS];
+}
+
+static uint32_t map_gen(struct pcb_t * proc) {
+	return __atomic_load_n(&proc->map_gen, __ATOMIC_ACQUIRE);
+}
+
+/* Software TLB, one per CPU. A TLB only caches translations of the last
+ * process which used it, for one mapping generation of that process.
+ * Switching process or unmapping memory therefore flushes it lazily. */
+#define TLB_SIZE	16	// Entries, direct-mapped on the virtual page
+
+struct tlb_entry_t {
+	int valid;
+	addr_t page;	// Virtual page number
+	addr_t frame;	// Physical frame number
+};
+
+struct tlb_t {
+	struct tlb_entry_t entry[TLB_SIZE];
+	uint32_t pid;	// Owner of the cached translations
+	uint32_t gen;	// Mapping generation of the owner
+	unsigned long nr_hits;
+	unsigned long nr_misses;
+	unsigned long nr_flushes;
+};
+
+static struct tlb_t _tlb0;	// Used until init_tlb() is called
+static struct tlb_t * _tlb = &_tlb0;
+static int _nr_tlb = 1;
+
+/* Find the first free frame at or above word [*w] of the frame map, mark
+ * it used and return its index. Caller makes sure there is one. */
+static int claim_frame(int * w) {
+	while (~_frame_map[*w] == 0) {
+		(*w)++;
+	}
+	int bit = __builtin_ctzll(~_frame_map[*w]);
+	_frame_map[*w] |= 1ULL << bit;
+	_used_frames++;
+	return *w * 64 + bit;
+}
+
+static void release_frame(int i) {
+	_frame_map[i / 64] &= ~(1ULL << (i % 64));
+	_used_frames--;
+	if (i / 64 < _first_free_word) {
+		_first_free_word = i / 64;
+	}
+}
+
+/* Buddy system, used instead of the frame map scan when init_mem() is
+ * given MEM_BUDDY. Free frames are kept as aligned blocks of 2^order
+ * frames, one list per order. An allocation splits the smallest block
+ * that is large enough and gives back what it does not need, so every
+ * allocation gets exactly its frames as one contiguous run. The frame
+ * map is kept up to date in both modes. */
+#define MAX_ORDER	30
+
+static int _buddy;	// Buddy system in use
+static int _max_order;	// Largest order which fits in memory
+
+static struct {
+	int head[MAX_ORDER + 1];	// First free block of each order
+	int nr_free[MAX_ORDER + 1];	// Free blocks of each order
+	int * next;	// Free block list links, -1 at the ends
+	int * prev;
+	signed char * order;	// Order of the free block starting at
+				// each frame, -1 if none
+	unsigned long nr_splits;
+	unsigned long nr_merges;
+} _free_area;
+
+static void buddy_push(int i, int order) {
+	_free_area.order[i] = order;
+	_free_area.prev[i] = -1;
+	_free_area.next[i] = _free_area.head[order];
+	if (_free_area.head[order] != -1) {
+		_free_area.prev[_free_area.head[order]] = i;
+	}
+	_free_area.head[order] = i;
+	_free_area.nr_free[order]++;
+}
+
+static void buddy_unlink(int i) {
+	int order = _free_area.order[i];
+	if (_free_area.prev[i] != -1) {
+		_free_area.next[_free_area.prev[i]] = _free_area.next[i];
+	}else{
+		_free_area.head[order] = _free_area.next[i];
+	}
+	if (_free_area.next[i] != -1) {
+		_free_area.prev[_free_area.next[i]] = _free_area.prev[i];
+	}
+	_free_area.order[i] = -1;
+	_free_area.nr_free[order]--;
+}
+
+/* Give back the block of 2^[order] frames at [i], merging it with its
+ * buddy for as long as the buddy is free too */
+static void buddy_free_block(int i, int order) {
+	while (order < _max_order) {
+		int buddy = i ^ (1 << order);
+		if (buddy >= NUM_PAGES || _free_area.order[buddy] != order) {
+			break;
+		}
+		buddy_unlink(buddy);
+		i &= ~(1 << order);
+		order++;
+		_free_area.nr_merges++;
+	}
+	buddy_push(i, order);
+}
+
+/* Give back [n] frames from [i] as the largest aligned blocks they hold */
+static void buddy_free_run(int i, int n) {
+	while (n > 0) {
+		int order = i ? __builtin_ctz(i) : _max_order;
+		if (order > _max_order) {
+			order = _max_order;
+		}
+		while ((1 << order) > n) {
+			order--;
+		}
+		buddy_free_block(i, order);
+		i += 1 << order;
+		n -= 1 << order;
+	}
+}
+
+/* Order of the smallest block holding [n] frames */
+static int buddy_order(int n) {
+	int order = 0;
+	while ((1 << order) < n) {
+		order++;
+	}
+	return order;
+}
+
+/* Return 1 if a run of [n] frames can be allocated */
+static int buddy_fits(int n) {
+	int k;
+	for (k = buddy_order(n); k <= _max_order; k++) {
+		if (_free_area.head[k] != -1) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Take a run of [n] frames and return its first frame. Caller makes sure
+ * buddy_fits(n) */
+static int buddy_alloc(int n) {
+	int order = buddy_order(n);
+	int k = order;
+	while (_free_area.head[k] == -1) {
+		k++;
+	}
+	int i = _free_area.head[k];
+	buddy_unlink(i);
+	for (; k > order; k--) {
+		buddy_push(i + (1 << (k - 1)), k - 1);
+		_free_area.nr_splits++;
+	}
+	buddy_free_run(i + n, (1 << order) - n);
+	return i;
+}
+
+/* Demand paging, enabled by MEM_DEMAND. Allocation only reserves virtual
+ * pages and a page gets a frame the first time it is translated. When no
+ * frame is free, the replacement policy picks a resident page to move to
+ * the swap area, a memory-mapped temporary file. Reservations are limited
+ * to RAM plus swap so a fault always finds room. Faults and evictions
+ * hold [mem_lock]. */
+#define SWAP_PAGES	(4 * NUM_PAGES)
+#define SWAP_WORDS	((SWAP_PAGES + 63) / 64)
+
+static int _demand;	// Demand paging in use
+static int _reserved_pages;	// Pages of every allocated region
+static BYTE * _swap;	// Swap area, SWAP_PAGES pages
+static size_t _swap_size;	// Bytes mapped at [_swap]
+static uint64_t * _swap_map;	// Bit set if the slot is in use
+static int _used_slots;
+
+static unsigned long _nr_faults;
+static unsigned long _nr_evictions;
+static unsigned long _nr_swapins;
+
+/* Set whenever a translation to the frame is used */
+static unsigned char * _referenced;
+
+/* Replacement policy, returns the frame to evict. Every used frame but
+ * those of shared memory holds a pageable page. */
+static int (*_pick_victim)(void);
+
+/* Clock: sweep the frames, clearing reference bits, and take the first
+ * one which has not been referenced since the last sweep */
+static int _clock_hand;
+
+static int clock_victim(void) {
+	while (1) {
+		int i = _clock_hand;
+		_clock_hand = (_clock_hand + 1) % NUM_PAGES;
+		if (!(_frame_map[i / 64] & (1ULL << (i % 64))) ||
+				_mem_stat[i].shm) {
+			continue;
+		}
+		if (_referenced[i]) {
+			_referenced[i] = 0;
+		}else{
+			return i;
+		}
+	}
+}
+
+/* Aging, an approximation of LRU: shift the reference bit of each frame
+ * into its age at every eviction and take the frame used least lately.
+ * Ties go to the first frame after the clock hand. */
+static unsigned char * _age;
+
+static int aging_victim(void) {
+	int n, victim = -1;
+	for (n = 0; n < NUM_PAGES; n++) {
+		int i = (_clock_hand + n) % NUM_PAGES;
+		if (!(_frame_map[i / 64] & (1ULL << (i % 64))) ||
+				_mem_stat[i].shm) {
+			continue;
+		}
+		_age[i] = (_age[i] >> 1) | (_referenced[i] << 7);
+		_referenced[i] = 0;
+		if (victim == -1 || _age[i] < _age[victim]) {
+			victim = i;
+		}
+	}
+	_clock_hand = (victim + 1) % NUM_PAGES;
+	return victim;
+}
+
+static int claim_slot(void) {
+	int w = 0;
+	while (~_swap_map[w] == 0) {
+		w++;
+	}
+	int bit = __builtin_ctzll(~_swap_map[w]);
+	_swap_map[w] |= 1ULL << bit;
+	_used_slots++;
+	return w * 64 + bit;
+}
+
+static void release_slot(int slot) {
+	_swap_map[slot / 64] &= ~(1ULL << (slot % 64));
+	_used_slots--;
+}
+
+int set_geometry(uint64_t ram_size, int segment_len, int page_len,
+		int offset_len) {
+	if (offset_len < 4 || segment_len < 1 || page_len < 1 ||
+			segment_len + page_len + offset_len > 31 ||
+			ram_size % ((uint64_t)1 << offset_len) != 0 ||
+			ram_size == 0 || ram_size > (uint64_t)1 << 31) {
+		return 1;
+	}
+	_geometry.offset_len = offset_len;
+	_geometry.segment_len = segment_len;
+	_geometry.page_len = page_len;
+	_geometry.num_pages = ram_size >> offset_len;
+	return 0;
+}
+
+void init_mem(int flags) {
+	if (_ram != NULL) {
+		munmap(_ram, RAM_SIZE);
+		free(_mem_stat);
+		free(_frame_map);
+	}
+	_ram = (BYTE *)mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (_ram == MAP_FAILED) {
+		printf("Cannot map %zu bytes of RAM\n", (size_t)RAM_SIZE);
+		exit(1);
+	}
+#ifdef MADV_HUGEPAGE
+	/* Only a hint, RAM works without huge pages */
+	madvise(_ram, RAM_SIZE, MADV_HUGEPAGE);
+#endif
+	_mem_stat = (struct mem_stat_t *)calloc(NUM_PAGES, sizeof(*_mem_stat));
+	_frame_map = (uint64_t *)calloc(MAP_WORDS, sizeof(uint64_t));
+	if (NUM_PAGES % 64) {
+		_frame_map[MAP_WORDS - 1] = ~0ULL << (NUM_PAGES % 64);
+	}
+	_used_frames = 0;
+	_first_free_word = 0;
+	_shm_frames = 0;
+	for (int i = 0; i < MAX_SHM; i++) {
+		free(_shm[i].pids);
+	}
+	memset(_shm, 0, sizeof(_shm));
 	pthread_mutex_init(&mem_lock, NULL);
+	/* Cached frames belonged to the old frame map */
+	for (int i = 0; i < _nr_mag; i++) {
+		_mag[i].nr = 0;
+	}
+	_cached_frames = 0;
+	_compacting = 0;
+	_freed_mark = _nr_freed;
+
+	_buddy = (flags & MEM_BUDDY) != 0;
+	if (_buddy) {
+		int i;
+		free(_free_area.next);
+		free(_free_area.prev);
+		free(_free_area.order);
+		memset(&_free_area, 0, sizeof(_free_area));
+		for (i = 0; i <= MAX_ORDER; i++) {
+			_free_area.head[i] = -1;
+		}
+		_free_area.next = (int *)malloc(NUM_PAGES * sizeof(int));
+		_free_area.prev = (int *)malloc(NUM_PAGES * sizeof(int));
+		_free_area.order = (signed char *)malloc(NUM_PAGES);
+		memset(_free_area.order, -1, NUM_PAGES);
+		_max_order = 0;
+		while (_max_order < MAX_ORDER && (2 << _max_order) <= NUM_PAGES) {
+			_max_order++;
+		}
+		buddy_free_run(0, NUM_PAGES);
+		_free_area.nr_merges = 0;
+	}
+
+	_demand = (flags & MEM_DEMAND) != 0;
+	if (_demand) {
+		_buddy = 0;
+		_reserved_pages = 0;
+		_used_slots = 0;
+		free(_swap_map);
+		free(_referenced);
+		free(_age);
+		_swap_map = (uint64_t *)calloc(SWAP_WORDS, sizeof(uint64_t));
+		_referenced = (unsigned char *)calloc(NUM_PAGES, 1);
+		_age = (unsigned char *)calloc(NUM_PAGES, 1);
+		_clock_hand = 0;
+		_pick_victim = (flags & MEM_AGING) ? aging_victim : clock_victim;
+		if (_swap != NULL) {
+			munmap(_swap, _swap_size);
+		}
+		_swap_size = (size_t)SWAP_PAGES * PAGE_SIZE;
+		FILE * file = tmpfile();
+		if (file == NULL || ftruncate(fileno(file), _swap_size) != 0) {
+			printf("Cannot create swap area\n");
+			exit(1);
+		}
+		_swap = (BYTE *)mmap(NULL, _swap_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fileno(file), 0);
+		if (_swap == MAP_FAILED) {
+			printf("Cannot map swap area\n");
+			exit(1);
+		}
+		/* The mapping keeps the file alive */
+		fclose(file);
+	}
 }
 
 
@@ -51,28 +579,81 @@ static addr_t get_second_lv(addr_t addr) {
 static struct page_table_t * get_page_table(
 		addr_t index, 	// Segment level index
 		struct seg_table_t * seg_table) { // first level table
-	
-	/*
-	 * TODO: Given the Segment index [index], you must go through each
-	 * row of the segment table [seg_table] and check if the v_index
-	 * field of the row is equal to the index
-	 *
-	 * */
+	/* The segment table is indexed directly by the segment index */
+	if (index >= (1 << SEGMENT_LEN)) {
+		return NULL;
+	}
+	return seg_table->table[index].pages;
 
-	int i;
-	for (i = 0; i < seg_table->size; i++) {
-		if (seg_table->table[i].v_index == index) { 
-			return seg_table->table[i].pages; // Return the page table from the segment index
-		}
+}
+
+/* Turn the large page of segment [first_lv] of [proc] into a page table
+ * mapping the same frames. Translations do not change, so cached ones
+ * stay good. */
+static void split_large(addr_t first_lv, struct pcb_t * proc) {
+	struct seg_entry_t * seg = &proc->seg_table->table[first_lv];
+	struct page_table_t * page_table = (struct page_table_t *)
+		arena_alloc(proc->arena, PAGE_TABLE_SIZE);
+	int j;
+	for (j = 0; j < (1 << PAGE_LEN); j++) {
+		struct pte_t * pte = &page_table->table[j];
+		pte->p_index = seg->p_index + j;
+		pte->valid = 1;
+		pte->present = 1;
+		pte->head = j == 0 && seg->head;
 	}
-	return NULL;
+	page_table->size = 1 << PAGE_LEN;
+	/* Lock-free walks look at [large] first */
+	seg->pages = page_table;
+	__atomic_store_n(&seg->large, 0, __ATOMIC_RELEASE);
+	_nr_splits++;
+}
 
+/* Row of the page table of [proc] for virtual address [addr], NULL if
+ * its segment has no page table. A large page over [addr] is split
+ * first, so that the row can be changed. */
+static struct pte_t * get_pte(addr_t addr, struct pcb_t * proc) {
+	addr_t first_lv = get_first_lv(addr);
+	if (first_lv < (1 << SEGMENT_LEN) &&
+			proc->seg_table->table[first_lv].large) {
+		split_large(first_lv, proc);
+	}
+	struct page_table_t * page_table =
+		get_page_table(first_lv, proc->seg_table);
+	if (page_table == NULL) {
+		return NULL;
+	}
+	return &page_table->table[get_second_lv(addr)];
 }
 
-/* Translate virtual address to physical address. If [virtual_addr] is valid,
- * return 1 and write its physical counterpart to [physical_addr].
- * Otherwise, return 0 */
-static int translate(
+/* Copy the mapping of virtual address [addr] of [proc], whichever kind,
+ * to [entry] without changing the tables. Return 0 if [addr] is not
+ * mapped by any region. */
+static int get_entry(addr_t addr, struct pcb_t * proc, struct pte_t * entry) {
+	addr_t first_lv = get_first_lv(addr);
+	if (first_lv >= (1 << SEGMENT_LEN)) {
+		return 0;
+	}
+	struct seg_entry_t * seg = &proc->seg_table->table[first_lv];
+	if (__atomic_load_n(&seg->large, __ATOMIC_ACQUIRE)) {
+		entry->p_index = seg->p_index + get_second_lv(addr);
+		entry->valid = 1;
+		entry->present = 1;
+		entry->head = get_second_lv(addr) == 0 && seg->head;
+		entry->swap = 0;
+		return 1;
+	}
+	if (seg->pages == NULL) {
+		return 0;
+	}
+	* entry = seg->pages->table[get_second_lv(addr)];
+	return entry->valid;
+}
+
+/* Walk the segment and page tables of [proc] to translate virtual address
+ * to physical address. If [virtual_addr] is valid, return 1 and write its
+ * physical counterpart to [physical_addr]. Otherwise, return 0 */
+static int walk_tables(
 		addr_t virtual_addr, 	// Given virtual address
 		addr_t * physical_addr, // Physical address to be returned
 		struct pcb_t * proc) {  // Process uses given virtual address
@@ -84,39 +665,848 @@ static int translate(
 	/* The second layer index */
 	addr_t second_lv = get_second_lv(virtual_addr); // Page index <-> 5 bits
 	
+	/* A large page needs the first level only */
+	if (first_lv < (1 << SEGMENT_LEN) && __atomic_load_n(
+			&proc->seg_table->table[first_lv].large,
+			__ATOMIC_ACQUIRE)) {
+		addr_t physical_index =
+			proc->seg_table->table[first_lv].p_index + second_lv;
+		* physical_addr = (physical_index << OFFSET_LEN) | offset;
+		return 1;
+	}
+
 	/* Search in the first level */
 	struct page_table_t * page_table = NULL;
 	page_table = get_page_table(first_lv, proc->seg_table); 
 	/*^ By using the first_lvl which is the segment index, we can find the page table
 		corresponding to it and then use the page table for the later process*/
-	if (page_table == NULL) {
+	if (page_table == NULL || !page_table->table[second_lv].present) {
+		return 0;
+	}
+
+	/* The second_lvl is the page index, it directly selects the row
+	   holding the frame number in page table of the corresponding segment */
+
+	/* TODO: Concatenate the offset of the virtual addess
+	 * to [p_index] field of page_table->table[i] to 
+	 * produce the correct physical address and save it to
+	 * [*physical_addr]  */
+
+	addr_t physical_index = page_table->table[second_lv].p_index;
+	* physical_addr = (physical_index << OFFSET_LEN) | offset; // Concatenate and save to p_addr
+	return 1;
+}
+
+/* A region mapped by a process: a memory block or an attached shared
+ * memory segment. The regions of a process are kept in a list carved
+ * from its arena, so that its exit releases them without walking its
+ * tables or _mem_stat. A frame cannot keep this list itself since
+ * shared frames are mapped by several processes. */
+struct region_t {
+	addr_t start;
+	struct region_t * next;
+};
+
+static void add_region(addr_t start, struct pcb_t * proc) {
+	struct region_t * region = (struct region_t *)
+		arena_alloc(proc->arena, sizeof(struct region_t));
+	region->start = start;
+	region->next = proc->regions;
+	proc->regions = region;
+}
+
+/* Return 0 if no region of [proc] starts at [start] */
+static int remove_region(addr_t start, struct pcb_t * proc) {
+	struct region_t ** link;
+	for (link = &proc->regions; *link != NULL; link = &(*link)->next) {
+		if ((*link)->start == start) {
+			struct region_t * region = *link;
+			*link = region->next;
+			arena_free(proc->arena, region, sizeof(struct region_t));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* A free range of virtual addresses below the break pointer of a process,
+ * left by a freed region. Holes are kept sorted by address, never touch
+ * each other or the break, and are carved from the arena of the process.
+ * Regions are packed at page granularity in the lowest hole they fit in,
+ * so that a process which allocates and frees keeps reusing the same few
+ * segments. Regions of a segment or more start on a segment boundary. */
+struct hole_t {
+	addr_t start;
+	addr_t end;
+	struct hole_t * next;
+};
+
+/* Give the [num_pages] virtual pages at [start] back to [proc] */
+static void put_range(addr_t start, int num_pages, struct pcb_t * proc) {
+	addr_t end = start + num_pages * PAGE_SIZE;
+	struct hole_t ** link = &proc->holes;
+	while (*link != NULL && (*link)->end < start) {
+		link = &(*link)->next;
+	}
+	struct hole_t * hole = *link;
+	if (hole != NULL && hole->end == start) {
+		hole->end = end;
+	}else if (hole != NULL && hole->start == end) {
+		hole->start = start;
+	}else{
+		hole = (struct hole_t *)
+			arena_alloc(proc->arena, sizeof(struct hole_t));
+		hole->start = start;
+		hole->end = end;
+		hole->next = *link;
+		*link = hole;
+	}
+	struct hole_t * next = hole->next;
+	if (next != NULL && next->start == hole->end) {
+		hole->end = next->end;
+		hole->next = next->next;
+		arena_free(proc->arena, next, sizeof(struct hole_t));
+	}
+	if (hole->end == proc->bp) {
+		/* The last hole gives its pages back to the break */
+		proc->bp = hole->start;
+		*link = NULL;
+		arena_free(proc->arena, hole, sizeof(struct hole_t));
+	}
+}
+
+/* Take [num_pages] free virtual pages of [proc] starting on a multiple of
+ * [align] bytes, from the lowest hole they fit in or else from the break.
+ * Return their address, or 0 if there is no room. */
+static addr_t take_aligned(int num_pages, uint64_t align,
+		struct pcb_t * proc) {
+	uint64_t size = (uint64_t)num_pages * PAGE_SIZE;
+	struct hole_t ** link;
+	for (link = &proc->holes; *link != NULL; link = &(*link)->next) {
+		struct hole_t * hole = *link;
+		uint64_t start = (hole->start + align - 1) & ~(align - 1);
+		if (start + size > hole->end) {
+			continue;
+		}
+		if (start == hole->start) {
+			hole->start += size;
+			if (hole->start == hole->end) {
+				*link = hole->next;
+				arena_free(proc->arena, hole, sizeof(struct hole_t));
+			}
+		}else if (start + size == hole->end) {
+			hole->end = start;
+		}else{
+			/* Split the hole around the range */
+			struct hole_t * rest = (struct hole_t *)
+				arena_alloc(proc->arena, sizeof(struct hole_t));
+			rest->start = start + size;
+			rest->end = hole->end;
+			rest->next = hole->next;
+			hole->end = start;
+			hole->next = rest;
+		}
+		return start;
+	}
+	uint64_t start = (proc->bp + align - 1) & ~(align - 1);
+	if (start + size > (uint64_t)1 << ADDRESS_SIZE) {
 		return 0;
 	}
+	addr_t gap = proc->bp;
+	proc->bp = start + size;
+	if (start > gap) {
+		/* The pages skipped below the range become a hole */
+		put_range(gap, (start - gap) / PAGE_SIZE, proc);
+	}
+	return start;
+}
 
+/* Take [num_pages] free virtual pages of [proc]. A range covering a whole
+ * segment starts on a segment boundary when there is room for it, so that
+ * it can be mapped with large pages. Return its address, or 0 if the
+ * address space is full. */
+static addr_t take_range(int num_pages, struct pcb_t * proc) {
+	if (num_pages >= (1 << PAGE_LEN)) {
+		addr_t start = take_aligned(num_pages,
+			(uint64_t)PAGE_SIZE << PAGE_LEN, proc);
+		if (start != 0) {
+			return start;
+		}
+	}
+	return take_aligned(num_pages, PAGE_SIZE, proc);
+}
+
+/* Map virtual page [addr] of [proc] to physical page [p_index], creating
+ * the page table of its segment if needed. With demand paging the page is
+ * only reserved and [p_index] is ignored. [head] marks the first page of
+ * a region. */
+static void map_page(addr_t addr, addr_t p_index, int head,
+		struct pcb_t * proc) {
+	struct seg_table_t * seg_table = proc->seg_table;
+	addr_t first_lv = get_first_lv(addr);
+	if (seg_table->table[first_lv].pages == NULL) {
+		seg_table->table[first_lv].pages = (struct page_table_t *)
+			arena_alloc(proc->arena, PAGE_TABLE_SIZE);
+		seg_table->size++;
+	}
+	struct page_table_t * page_table = seg_table->table[first_lv].pages;
+	struct pte_t * pte = &page_table->table[get_second_lv(addr)];
+	pte->p_index = p_index;
+	pte->valid = 1;
+	pte->present = !_demand;
+	pte->head = head;
+	pte->swap = 0;
+	page_table->size++;
+}
+
+/* Map the whole segment of [addr] of [proc] to the contiguous frames
+ * starting at [p_index] with a large page */
+static void map_large(addr_t addr, addr_t p_index, int head,
+		struct pcb_t * proc) {
+	struct seg_entry_t * seg = &proc->seg_table->table[get_first_lv(addr)];
+	seg->p_index = p_index;
+	seg->head = head;
+	seg->large = 1;
+	proc->seg_table->size++;
+	_nr_large++;
+}
+
+/* Remove the mapping of virtual page [addr] of [proc], and the page table
+ * of its segment once it maps nothing */
+static void unmap_page(addr_t addr, struct pcb_t * proc) {
+	struct seg_table_t * seg_table = proc->seg_table;
+	addr_t first_lv = get_first_lv(addr);
+	struct page_table_t * page_table = seg_table->table[first_lv].pages;
+	if (page_table == NULL || !page_table->table[get_second_lv(addr)].valid) {
+		return;
+	}
+	page_table->table[get_second_lv(addr)].valid = 0;
+	page_table->table[get_second_lv(addr)].present = 0;
+	if (--page_table->size == 0) {
+		arena_free(proc->arena, page_table, PAGE_TABLE_SIZE);
+		seg_table->table[first_lv].pages = NULL;
+		seg_table->size--;
+	}
+}
+
+/* Forget every cached translation of [proc], on every CPU, and make
+ * reads in flight retry. Must be called before unmapped frames can be
+ * reused. */
+static void flush_tlb(struct pcb_t * proc) {
+	__atomic_add_fetch(&proc->map_gen, 1, __ATOMIC_RELEASE);
+}
+
+/* Pick the TLB of the CPU running [proc] and drop its entries if they
+ * belong to another process or to an older mapping generation */
+static struct tlb_t * get_tlb(struct pcb_t * proc) {
+	struct tlb_t * tlb = &_tlb[proc->cpu >= 0 && proc->cpu < _nr_tlb ?
+		proc->cpu : 0];
+	uint32_t gen = map_gen(proc);
+	if (tlb->pid != proc->pid || tlb->gen != gen) {
+		int i;
+		for (i = 0; i < TLB_SIZE; i++) {
+			tlb->entry[i].valid = 0;
+		}
+		tlb->pid = proc->pid;
+		tlb->gen = gen;
+		tlb->nr_flushes++;
+	}
+	return tlb;
+}
+
+/* Look [virtual_addr] up in the TLB, then in the tables of [proc]. Return
+ * 1 and write the physical address to [physical_addr] if the page is
+ * present in memory, 0 otherwise */
+static int lookup(
+		addr_t virtual_addr, 	// Given virtual address
+		addr_t * physical_addr, // Physical address to be returned
+		struct pcb_t * proc) {  // Process uses given virtual address
+	struct tlb_t * tlb = get_tlb(proc);
+	addr_t page = virtual_addr >> OFFSET_LEN;
+	struct tlb_entry_t * entry = &tlb->entry[page % TLB_SIZE];
+	if (entry->valid && entry->page == page) {
+		tlb->nr_hits++;
+		if (_demand) {
+			_referenced[entry->frame] = 1;
+		}
+		* physical_addr = (entry->frame << OFFSET_LEN) |
+			get_offset(virtual_addr);
+		return 1;
+	}
+	tlb->nr_misses++;
+	if (!walk_tables(virtual_addr, physical_addr, proc)) {
+		return 0;
+	}
+	entry->valid = 1;
+	entry->page = page;
+	entry->frame = * physical_addr >> OFFSET_LEN;
+	if (_demand) {
+		_referenced[entry->frame] = 1;
+	}
+	return 1;
+}
+
+/* Move the page in the frame picked by the replacement policy to swap
+ * and return the frame, which stays marked as used. The page table row is
+ * updated before the generation of the owner is bumped, both under the
+ * frame lock, so that concurrent reads and writes of the owner retry and
+ * find the page gone. */
+static int evict_frame(void) {
+	int i = _pick_victim();
+	struct pcb_t * owner = _mem_stat[i].owner;
+	struct pte_t * pte = get_pte(_mem_stat[i].page, owner);
+	int slot = claim_slot();
+	pthread_mutex_t * lock = get_frame_lock(i << OFFSET_LEN);
+	pthread_mutex_lock(lock);
+	pte->present = 0;
+	pte->swap = slot + 1;
+	flush_tlb(owner);
+	memcpy(&_swap[(size_t)slot * PAGE_SIZE], &_ram[i << OFFSET_LEN],
+		PAGE_SIZE);
+	pthread_mutex_unlock(lock);
+	_nr_evictions++;
+	return i;
+}
+
+/* Bring the page of [virtual_addr] into memory. Return 0 if the address
+ * does not belong to any region of [proc] */
+static int fault_in(addr_t virtual_addr, struct pcb_t * proc) {
+	lock_mem();
+	struct pte_t * pte = get_pte(virtual_addr, proc);
+	if (pte == NULL || !pte->valid) {
+		unlock_mem();
+		return 0;
+	}
+	if (!pte->present) {
+		_nr_faults++;
+		int i;
+		if (_used_frames < NUM_PAGES) {
+			i = claim_frame(&_first_free_word);
+		}else{
+			i = evict_frame();
+		}
+		BYTE * frame = &_ram[i << OFFSET_LEN];
+		if (pte->swap) {
+			memcpy(frame,
+				&_swap[(size_t)(pte->swap - 1) * PAGE_SIZE],
+				PAGE_SIZE);
+			release_slot(pte->swap - 1);
+			pte->swap = 0;
+			_nr_swapins++;
+		}else{
+			memset(frame, 0, PAGE_SIZE);
+		}
+		_mem_stat[i].proc = proc->pid;
+		_mem_stat[i].index = virtual_addr >> OFFSET_LEN;
+		_mem_stat[i].next = -1;
+		_mem_stat[i].refs = 1;
+		_mem_stat[i].shm = 0;
+		_mem_stat[i].owner = proc;
+		_mem_stat[i].page = virtual_addr - get_offset(virtual_addr);
+		_referenced[i] = 1;
+		_age[i] = 0;
+		pte->p_index = i;
+		__atomic_store_n(&pte->present, 1, __ATOMIC_RELEASE);
+	}
+	unlock_mem();
+	return 1;
+}
+
+/* Translate virtual address to physical address. If [virtual_addr] is valid,
+ * return 1 and write its physical counterpart to [physical_addr].
+ * Otherwise, return 0. With demand paging, a page which is not in memory
+ * is faulted in. */
+static int translate(
+		addr_t virtual_addr, 	// Given virtual address
+		addr_t * physical_addr, // Physical address to be returned
+		struct pcb_t * proc) {  // Process uses given virtual address
+	while (!lookup(virtual_addr, physical_addr, proc)) {
+		if (!_demand || !fault_in(virtual_addr, proc)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Take a free frame for one page. Caller makes sure there is one */
+static int take_frame(void) {
+	if (!_buddy) {
+		return claim_frame(&_first_free_word);
+	}
+	int i = buddy_alloc(1);
+	_frame_map[i / 64] |= 1ULL << (i % 64);
+	_used_frames++;
+	return i;
+}
+
+/* Magazine of the CPU running [proc], NULL if it must not use one */
+static struct magazine_t * get_magazine(struct pcb_t * proc) {
+	if (_demand || _buddy || proc->cpu < 0 || proc->cpu >= _nr_mag) {
+		return NULL;
+	}
+	return &_mag[proc->cpu];
+}
+
+static void leave_magazine(struct magazine_t * mag) {
+	__atomic_store_n(&mag->user, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&mag->lock);
+}
+
+/* Lock magazine [mag] for [proc]. Return 0, leaving it unlocked, if a
+ * compaction pass is going on. The pass sets [_compacting] before it
+ * looks at [user], so either [proc] sees the pass or the pass sees
+ * [proc] and leaves its pages alone. */
+static int enter_magazine(struct magazine_t * mag, struct pcb_t * proc) {
+	pthread_mutex_lock(&mag->lock);
+	__atomic_store_n(&mag->user, proc, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&_compacting, __ATOMIC_SEQ_CST)) {
+		leave_magazine(mag);
+		return 0;
+	}
+	return 1;
+}
+
+/* Return 1 if [proc] is changing its tables through a magazine */
+static int in_magazine(struct pcb_t * proc) {
 	int i;
-	for (i = 0; i < page_table->size; i++) {
-		if (page_table->table[i].v_index == second_lv) {
+	for (i = 0; i < _nr_mag; i++) {
+		if (__atomic_load_n(&_mag[i].user, __ATOMIC_SEQ_CST) == proc) {
+			return 1;
+		}
+	}
+	return 0;
+}
 
-			/* The second_lvl is the page index, that will used along with page base number
-			   to find the correct frame number in page table of the corresponding segment */
+/* Top up the magazine [mag] of a CPU which missed, unless a compaction
+ * pass is going on or that could leave the frame map with less than two
+ * batches free. Caller holds [mem_lock]. */
+static void refill_magazine(struct magazine_t * mag) {
+	if (_compacting || NUM_PAGES - _used_frames < 4 * MAG_BATCH ||
+			pthread_mutex_trylock(&mag->lock) != 0) {
+		return;
+	}
+	while (mag->nr < 2 * MAG_BATCH) {
+		mag->frames[mag->nr++] = claim_frame(&_first_free_word);
+		__atomic_add_fetch(&_cached_frames, 1, __ATOMIC_RELAXED);
+	}
+	mag->nr_refills++;
+	pthread_mutex_unlock(&mag->lock);
+}
 
-			/* In short: It it used to find the frame number in page table */
+/* Give [n] frames of [mag] back to the frame map. Caller holds the
+ * magazine lock. */
+static void drain_magazine(struct magazine_t * mag, int n) {
+	lock_mem();
+	while (n-- > 0 && mag->nr > 0) {
+		release_frame(mag->frames[--mag->nr]);
+		__atomic_sub_fetch(&_cached_frames, 1, __ATOMIC_RELAXED);
+	}
+	unlock_mem();
+	mag->nr_drains++;
+}
 
-			/* TODO: Concatenate the offset of the virtual addess
-			 * to [p_index] field of page_table->table[i] to 
-			 * produce the correct physical address and save it to
-			 * [*physical_addr]  */
+/* Give every frame of [mag] back to the frame map. Caller holds
+ * [mem_lock] and the magazine lock. */
+static void empty_magazine(struct magazine_t * mag) {
+	while (mag->nr > 0) {
+		release_frame(mag->frames[--mag->nr]);
+		__atomic_sub_fetch(&_cached_frames, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* Make sure the frame map has [n] free frames, taking back the frames
+ * of the magazines not in use if needed. Return 1 if it has. Caller
+ * holds [mem_lock]. */
+static int reserve_frames(int n) {
+	int i;
+	for (i = 0; i < _nr_mag && NUM_PAGES - _used_frames < n; i++) {
+		struct magazine_t * mag = &_mag[i];
+		if (mag->nr == 0 || pthread_mutex_trylock(&mag->lock) != 0) {
+			continue;
+		}
+		empty_magazine(mag);
+		pthread_mutex_unlock(&mag->lock);
+	}
+	return NUM_PAGES - _used_frames >= n;
+}
+
+/* Allocate [num_pages] pages, at most MAG_BATCH, to [proc] from
+ * magazine [mag] without holding [mem_lock]. Return 0 if the magazine
+ * has too few frames or the address space is full. */
+static addr_t alloc_cached(int num_pages, struct pcb_t * proc,
+		struct magazine_t * mag) {
+	int * frames;	// Taken from the top of the magazine
+	int k;
+	if (!enter_magazine(mag, proc)) {
+		return 0;
+	}
+	addr_t ret_mem = mag->nr < num_pages ? 0 : take_range(num_pages, proc);
+	if (ret_mem == 0) {
+		leave_magazine(mag);
+		return 0;
+	}
+	frames = &mag->frames[mag->nr - 1];
+	for (k = 0; k < num_pages; k++) {
+		int i = frames[-k];
+		_mem_stat[i].proc = proc->pid;
+		_mem_stat[i].index = k;
+		_mem_stat[i].next = k + 1 < num_pages ? frames[-k - 1] : -1;
+		_mem_stat[i].refs = 1;
+		_mem_stat[i].shm = 0;
+		_mem_stat[i].owner = proc;
+		_mem_stat[i].page = ret_mem + k * PAGE_SIZE;
+		map_page(ret_mem + k * PAGE_SIZE, i, k == 0, proc);
+	}
+	mag->nr -= num_pages;
+	mag->nr_allocs++;
+	add_region(ret_mem, proc);
+	leave_magazine(mag);
+	__atomic_sub_fetch(&_cached_frames, num_pages, __ATOMIC_RELAXED);
+	return ret_mem;
+}
 
-			addr_t physical_index = page_table->table[i].p_index;
-			* physical_addr = (physical_index << OFFSET_LEN) | offset; // Concatenate and save to p_addr
+/* Copy-on-write fault: give [proc] its own copy of the shared frame
+ * behind [address]. The copy is made under the lock of the shared frame,
+ * so a sharer which finds the frame no longer shared has seen the copy
+ * done. Return 1 if there is no free frame for the copy, 0 otherwise. */
+static int unshare_page(addr_t address, struct pcb_t * proc) {
+	/* Only [proc] itself can make its private pages shared, by forking,
+	 * so a page seen private without the lock needs nothing */
+	struct pte_t entry;
+	if (!get_entry(address, proc, &entry) || !entry.present ||
+			!cow_frame(entry.p_index)) {
+		return 0;
+	}
+	lock_mem();
+	if (get_entry(address, proc, &entry) && entry.present &&
+			cow_frame(entry.p_index)) {
+		if (!reserve_frames(1)) {
+			unlock_mem();
 			return 1;
 		}
+		struct pte_t * pte = get_pte(address, proc);
+		int i = pte->p_index;
+		int j = take_frame();
+		pthread_mutex_t * lock = get_frame_lock(i << OFFSET_LEN);
+		pthread_mutex_lock(lock);
+		memcpy(&_ram[j << OFFSET_LEN], &_ram[i << OFFSET_LEN], PAGE_SIZE);
+		_mem_stat[j].proc = proc->pid;
+		_mem_stat[j].index = _mem_stat[i].index;
+		_mem_stat[j].next = -1;
+		_mem_stat[j].refs = 1;
+		_mem_stat[j].shm = 0;
+		_mem_stat[j].owner = proc;
+		_mem_stat[j].page = address - get_offset(address);
+		leave_frame(i, proc);
+		__atomic_sub_fetch(&_mem_stat[i].refs, 1, __ATOMIC_ACQ_REL);
+		pte->p_index = j;
+		flush_tlb(proc);
+		pthread_mutex_unlock(lock);
+		_nr_cow_faults++;
+	}
+	unlock_mem();
+	return 0;
+}
+
+static void add_shm_pid(int id, uint32_t pid) {
+	struct shm_t * shm = &_shm[id];
+	shm->pids = (uint32_t *)realloc(shm->pids,
+		(shm->nr_attached + 1) * sizeof(uint32_t));
+	shm->pids[shm->nr_attached++] = pid;
+}
+
+static void remove_shm_pid(int id, uint32_t pid) {
+	struct shm_t * shm = &_shm[id];
+	int i;
+	for (i = 0; i < shm->nr_attached; i++) {
+		if (shm->pids[i] == pid) {
+			shm->pids[i] = shm->pids[--shm->nr_attached];
+			break;
+		}
+	}
+	/* The last process has gone and its frames with it, free the slot
+	 * for another key */
+	if (shm->nr_attached == 0) {
+		free(shm->pids);
+		memset(shm, 0, sizeof(struct shm_t));
+	}
+}
+
+int fork_mem(struct pcb_t * parent, struct pcb_t * child) {
+	lock_mem();
+	struct seg_table_t * seg_table = parent->seg_table;
+	int num_pages = 0;	// Private pages of the parent
+	int num_copies = 0;	// Private pages with content, in memory or
+				// in swap
+	int i, j;
+	for (i = 0; i < (1 << SEGMENT_LEN); i++) {
+		struct page_table_t * page_table = seg_table->table[i].pages;
+		if (page_table == NULL) {
+			continue;
+		}
+		for (j = 0; j < (1 << PAGE_LEN); j++) {
+			struct pte_t * pte = &page_table->table[j];
+			if (!pte->valid ||
+				(pte->present && _mem_stat[pte->p_index].shm)) {
+				continue;
+			}
+			num_pages++;
+			if (pte->present || pte->swap) {
+				num_copies++;
+			}
+		}
+	}
+	/* Shared frames cost nothing up front, copies in swap do */
+	if (_demand && (_used_slots + num_copies > SWAP_PAGES ||
+			_reserved_pages + num_pages >
+				NUM_PAGES - _shm_frames + SWAP_PAGES - 1)) {
+		unlock_mem();
+		return 1;
+	}
+
+	for (i = 0; i < (1 << SEGMENT_LEN); i++) {
+		if (seg_table->table[i].large) {
+			/* Only private frames, demand paging has no large
+			 * pages */
+			child->seg_table->table[i] = seg_table->table[i];
+			child->seg_table->size++;
+			for (j = 0; j < (1 << PAGE_LEN); j++) {
+				share_frame(seg_table->table[i].p_index + j,
+					child);
+			}
+			continue;
+		}
+		struct page_table_t * page_table = seg_table->table[i].pages;
+		if (page_table == NULL) {
+			continue;
+		}
+		struct page_table_t * copy = (struct page_table_t *)
+			arena_alloc(child->arena, PAGE_TABLE_SIZE);
+		memcpy(copy, page_table, PAGE_TABLE_SIZE);
+		child->seg_table->table[i].pages = copy;
+		child->seg_table->size++;
+		for (j = 0; j < (1 << PAGE_LEN); j++) {
+			struct pte_t * pte = &copy->table[j];
+			if (!pte->valid) {
+				continue;
+			}
+			if (pte->present && _mem_stat[pte->p_index].shm) {
+				/* The child is attached to the segment too */
+				_mem_stat[pte->p_index].refs++;
+				if (pte->head) {
+					add_shm_pid(_mem_stat[pte->p_index].shm - 1,
+						child->pid);
+				}
+			}else if (!_demand) {
+				share_frame(pte->p_index, child);
+			}else if (pte->present || pte->swap) {
+				/* A frame has a single owner which eviction
+				 * can unmap, so give the child its own copy
+				 * in swap instead */
+				int slot = claim_slot();
+				BYTE * page = pte->present ?
+					&_ram[pte->p_index << OFFSET_LEN] :
+					&_swap[(size_t)(pte->swap - 1) * PAGE_SIZE];
+				memcpy(&_swap[(size_t)slot * PAGE_SIZE], page,
+					PAGE_SIZE);
+				pte->present = 0;
+				pte->swap = slot + 1;
+			}
+		}
+	}
+	struct region_t * region;
+	for (region = parent->regions; region != NULL; region = region->next) {
+		add_region(region->start, child);
+	}
+	struct hole_t * hole;
+	struct hole_t ** link = &child->holes;
+	for (hole = parent->holes; hole != NULL; hole = hole->next) {
+		*link = (struct hole_t *)
+			arena_alloc(child->arena, sizeof(struct hole_t));
+		(*link)->start = hole->start;
+		(*link)->end = hole->end;
+		link = &(*link)->next;
+	}
+	if (_demand) {
+		_reserved_pages += num_pages;
+	}
+	_nr_forks++;
+	unlock_mem();
+	return 0;
+}
+
+void init_tlb(int num_cpus) {
+	if (_tlb != &_tlb0) {
+		free(_tlb);
+	}
+	_tlb = (struct tlb_t *)calloc(num_cpus, sizeof(struct tlb_t));
+	_nr_tlb = num_cpus;
+
+	int i;
+	lock_mem();
+	reserve_frames(NUM_PAGES);
+	unlock_mem();
+	for (i = 0; i < _nr_mag; i++) {
+		pthread_mutex_destroy(&_mag[i].lock);
+	}
+	free(_mag);
+	_mag = (struct magazine_t *)aligned_alloc(64,
+		num_cpus * sizeof(struct magazine_t));
+	memset(_mag, 0, num_cpus * sizeof(struct magazine_t));
+	for (i = 0; i < num_cpus; i++) {
+		pthread_mutex_init(&_mag[i].lock, NULL);
+	}
+	_nr_mag = num_cpus;
+}
+
+/* Length of the longest run of free frames, cached ones included */
+static int largest_free_run(void) {
+	int i, k, run = 0, largest = 0;
+	char * cached = (char *)calloc(NUM_PAGES, 1);
+	for (i = 0; i < _nr_mag; i++) {
+		for (k = 0; k < _mag[i].nr; k++) {
+			cached[_mag[i].frames[k]] = 1;
+		}
+	}
+	for (i = 0; i < NUM_PAGES; i++) {
+		if ((_frame_map[i / 64] & (1ULL << (i % 64))) && !cached[i]) {
+			run = 0;
+		}else if (++run > largest) {
+			largest = run;
+		}
 	}
-	return 0;	
+	free(cached);
+	return largest;
+}
+
+void mem_stats(void) {
+	unsigned long hits = 0, misses = 0, flushes = 0;
+	int i;
+	for (i = 0; i < _nr_tlb; i++) {
+		hits += _tlb[i].nr_hits;
+		misses += _tlb[i].nr_misses;
+		flushes += _tlb[i].nr_flushes;
+	}
+	printf("TLB hits: %lu, misses: %lu, flushes: %lu\n",
+		hits, misses, flushes);
+
+	/* External fragmentation: share of free frames which are not part
+	 * of the largest free run */
+	int free_frames = NUM_PAGES - _used_frames + _cached_frames;
+	int largest = largest_free_run();
+	printf("Free frames: %d, largest free run: %d, fragmentation: %d%%\n",
+		free_frames, largest,
+		free_frames ? 100 - largest * 100 / free_frames : 0);
+	int shared = 0, refs = 0;
+	for (i = 0; i < NUM_PAGES; i++) {
+		if (cow_frame(i)) {
+			shared++;
+			refs += _mem_stat[i].refs;
+		}
+	}
+	printf("Forks: %lu, COW faults: %lu, shared frames: %d (references: %d)\n",
+		_nr_forks, _nr_cow_faults, shared, refs);
+	int segments = 0, attached = 0;
+	for (i = 0; i < MAX_SHM; i++) {
+		if (_shm[i].num_pages != 0) {
+			segments++;
+			attached += _shm[i].nr_attached;
+		}
+	}
+	printf("Shared memory segments: %d, frames: %d, attachments: %d\n",
+		segments, _shm_frames, attached);
+	printf("Large pages mapped: %lu, split: %lu\n", _nr_large, _nr_splits);
+	if (_nr_passes > 0) {
+		printf("Compaction: %lu passes, %lu pages moved\n",
+			_nr_passes, _nr_moved);
+	}
+	printf("Memory lock: %lu acquisitions (contended: %lu), held %lu us\n",
+		_nr_mem_locks, _nr_mem_contended,
+		(unsigned long)(_mem_lock_ns / 1000));
+	if (_nr_mag > 0 && !_demand && !_buddy) {
+		unsigned long allocs = 0, frees = 0, refills = 0, drains = 0;
+		for (i = 0; i < _nr_mag; i++) {
+			allocs += _mag[i].nr_allocs;
+			frees += _mag[i].nr_frees;
+			refills += _mag[i].nr_refills;
+			drains += _mag[i].nr_drains;
+		}
+		printf("Magazines: %lu allocations, %lu frees, %lu refills, "
+			"%lu drains, %d frames cached\n",
+			allocs, frees, refills, drains, _cached_frames);
+	}
+	if (_demand) {
+		printf("Page faults: %lu, evictions: %lu, swap-ins: %lu\n",
+			_nr_faults, _nr_evictions, _nr_swapins);
+	}
+	if (_buddy) {
+		printf("Free blocks by order:");
+		for (i = 0; i <= _max_order; i++) {
+			printf(" %d", _free_area.nr_free[i]);
+		}
+		printf("\nBuddy splits: %lu, merges: %lu\n",
+			_free_area.nr_splits, _free_area.nr_merges);
+	}
+}
+
+/* Take [num_pages] free frames for process [pid], list them in _mem_stat
+ * and return the first one. The frames are not mapped yet. Caller makes
+ * sure there are enough. */
+static int take_frames(int num_pages, uint32_t pid) {
+	int curr_page = 0;
+	int prev_mem_index = -1;
+	int phy_index = 0;
+	int word = _first_free_word;
+	int run = _buddy ? buddy_alloc(num_pages) : -1;
+	while (curr_page < num_pages)
+	{
+		int i;
+		if (_buddy) {
+			i = run + curr_page;
+			_frame_map[i / 64] |= 1ULL << (i % 64);
+			_used_frames++;
+		}else{
+			i = claim_frame(&word);
+		}
+		//Update [proc], [index], and [next] field
+		if (prev_mem_index == -1)
+		{
+			phy_index = i;
+		}
+		else
+		{
+			_mem_stat[prev_mem_index].next = i;
+		}
+
+		_mem_stat[i].proc = pid;
+		_mem_stat[i].index = curr_page;
+		_mem_stat[i].next = -1;
+		_mem_stat[i].refs = 0;
+		_mem_stat[i].shm = 0;
+		_mem_stat[i].owner = NULL;
+		prev_mem_index = i;
+		curr_page++;
+	}
+	if (!_buddy) {
+		_first_free_word = word;
+	}
+	return phy_index;
+}
+
+/* Return 1 if the [n] frames of the list starting at frame [i] follow
+ * each other in memory */
+static int contiguous(int i, int n) {
+	int k;
+	for (k = 1; k < n; k++) {
+		if (_mem_stat[i].next != i + 1) {
+			return 0;
+		}
+		i++;
+	}
+	return 1;
 }
 
 addr_t alloc_mem(uint32_t size, struct pcb_t * proc) {
-	pthread_mutex_lock(&mem_lock);
 	addr_t ret_mem = 0;
 	/* TODO: Allocate [size] byte in the memory for the
 	 * process [proc] and save the address of the first
@@ -125,6 +1515,14 @@ addr_t alloc_mem(uint32_t size, struct pcb_t * proc) {
 
 	uint32_t num_pages = (size % PAGE_SIZE) ? size / PAGE_SIZE + 1 :
 		size / PAGE_SIZE; // Number of pages we will use
+	struct magazine_t * mag = get_magazine(proc);
+	if (mag != NULL && num_pages > 0 && num_pages <= MAG_BATCH) {
+		ret_mem = alloc_cached(num_pages, proc, mag);
+		if (ret_mem != 0) {
+			return ret_mem;
+		}
+	}
+	lock_mem();
 	int mem_avail = 0; // We could allocate new memory region or not?
 	/* First we must check if the amount of free memory in
 	 * virtual address space and physical address space is
@@ -135,20 +1533,29 @@ addr_t alloc_mem(uint32_t size, struct pcb_t * proc) {
 	 * For virtual memory space, check bp (break pointer).
 	 * */
 	//Check physical
-	int phy_free_pages = 0;
-	for (int i = 0; i < NUM_PAGES; i++)
-	{
-		if (_mem_stat[i].proc == 0) phy_free_pages++;
+	if (!_demand) {
+		reserve_frames(num_pages);
 	}
+	int phy_free_pages = NUM_PAGES - _used_frames;
 
-	mem_avail = phy_free_pages >= num_pages;
+	if (_demand) {
+		/* Frames are found when pages are first used. One swap slot
+		 * is left for a fault which evicts a page before it swaps
+		 * its own page in. */
+		phy_free_pages = NUM_PAGES - _shm_frames + SWAP_PAGES - 1 -
+			_reserved_pages;
+	}
+	mem_avail = num_pages > 0 &&
+		phy_free_pages >= num_pages &&
+		(!_buddy || buddy_fits(num_pages));
+	if (mem_avail) {
+		ret_mem = take_range(num_pages, proc);
+		mem_avail = ret_mem != 0;
+	}
 
 	if (mem_avail) {
 		/* We could allocate new memory region to the process */
-		ret_mem = proc->bp;
 		//printf("seg_idx: %x		page_idx: %x	\n", get_first_lv(ret_mem), get_second_lv(ret_mem));
-		int num_seg_entries = num_pages % (1 << PAGE_LEN) ? num_pages / (1 << PAGE_LEN) + 1 : num_pages / (1 << PAGE_LEN);
-		proc->bp += num_seg_entries * (1 << PAGE_LEN) * PAGE_SIZE; //offset n segment
 		/* Update status of physical pages which will be allocated
 		 * to [proc] in _mem_stat. Tasks to do:
 		 * 	- Update [proc], [index], and [next] field
@@ -156,62 +1563,189 @@ addr_t alloc_mem(uint32_t size, struct pcb_t * proc) {
 		 * 	  to ensure accesses to allocated memory slot is
 		 * 	  valid. */
 		int curr_page = 0;
-		int prev_mem_index = -1;
-		int phy_index = 0;
-		int flag = 0;
-		for (int i = 0; i < NUM_PAGES; i++)
-		{
-			if (_mem_stat[i].proc == 0)
-			{
-				//Update [proc], [index], and [next] field
-				if (flag == 0)
-				{
-					phy_index = i;
-					flag = 1;
-				}
-
-				_mem_stat[i].proc = proc->pid;
-				_mem_stat[i].index = curr_page;
-				if (prev_mem_index != -1)
-				{
-					_mem_stat[prev_mem_index].next = i;
-				}
-				prev_mem_index = i;
-
-				curr_page++;
-				if (curr_page == num_pages)
-				{
-					_mem_stat[i].next = -1;
-					break;
-				}
+		if (_demand) {
+			for (; curr_page < num_pages; curr_page++) {
+				map_page(ret_mem + curr_page * PAGE_SIZE, 0,
+					curr_page == 0, proc);
 			}
+			_reserved_pages += num_pages;
+			add_region(ret_mem, proc);
+			unlock_mem();
+			return ret_mem;
 		}
+		int phy_index = take_frames(num_pages, proc->pid);
 
-		for (int seg_idx = 0; seg_idx < num_seg_entries; seg_idx++)
-		{
-			proc->seg_table->table[proc->seg_table->size].v_index = get_first_lv(ret_mem + seg_idx * (1 << PAGE_LEN) * PAGE_SIZE);
-			proc->seg_table->table[proc->seg_table->size].pages = (struct page_table_t *)malloc(sizeof(struct page_table_t));
-			proc->seg_table->table[proc->seg_table->size].pages->size = 0;
-			proc->seg_table->size++;
-		}
-	
 		curr_page = 0;
 		for (int i = phy_index; i != -1; i = _mem_stat[i].next)
 		{
+			addr_t addr = ret_mem + curr_page * PAGE_SIZE;
+			if (get_second_lv(addr) == 0 &&
+					num_pages - curr_page >= (1 << PAGE_LEN) &&
+					contiguous(i, 1 << PAGE_LEN)) {
+				/* The segment is covered by contiguous frames */
+				map_large(addr, i, curr_page == 0, proc);
+				int j;
+				for (j = 0; j < (1 << PAGE_LEN); j++) {
+					_mem_stat[i + j].refs++;
+					_mem_stat[i + j].owner = proc;
+					_mem_stat[i + j].page = addr + j * PAGE_SIZE;
+				}
+				i += (1 << PAGE_LEN) - 1;
+				curr_page += 1 << PAGE_LEN;
+				continue;
+			}
 			//Add entries to segment table page tables of [proc]
-			addr_t cur_vir_addr = ret_mem + curr_page * PAGE_SIZE;
-			struct page_table_t *located_page_table = get_page_table(get_first_lv(cur_vir_addr), proc->seg_table);
-			located_page_table->table[located_page_table->size].v_index = get_second_lv(cur_vir_addr);
-			located_page_table->table[located_page_table->size].p_index = i;
-			located_page_table->size++;
+			map_page(addr, i, curr_page == 0, proc);
+			_mem_stat[i].refs++;
+			_mem_stat[i].owner = proc;
+			_mem_stat[i].page = addr;
 			curr_page++;
-			//printf("alloc 	first lv: %x	second lv: %x	curr_page: %d\n", proc->seg_table->table[0].v_index, proc->seg_table->table[0].pages->table[proc->seg_table->table[0].pages->size - 1].v_index, curr_page);
+		}
+		add_region(ret_mem, proc);
+		if (mag != NULL && num_pages <= MAG_BATCH) {
+			refill_magazine(mag);
 		}
 	}
-	pthread_mutex_unlock(&mem_lock);
+	unlock_mem();
 	return ret_mem;
 }
 
+/* Drop the reference of [proc] to frame [i], releasing it with the last
+ * one */
+static void put_frame(int i, struct pcb_t * proc) {
+	if (cow_frame(i)) {
+		leave_frame(i, proc);
+	}
+	/* Atomic as private_region() reads counts without [mem_lock] */
+	if (__atomic_sub_fetch(&_mem_stat[i].refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	if (_mem_stat[i].shm) {
+		struct shm_t * shm = &_shm[_mem_stat[i].shm - 1];
+		if (--shm->nr_frames == 0) {
+			shm->first = -1;
+		}
+		_shm_frames--;
+		_mem_stat[i].shm = 0;
+	}
+	_mem_stat[i].proc = 0;
+	_mem_stat[i].owner = NULL;
+	release_frame(i);
+	__atomic_add_fetch(&_nr_freed, 1, __ATOMIC_RELAXED);
+	if (_buddy) {
+		buddy_free_run(i, 1);
+	}
+}
+
+/* Put private frame [i] in magazine [mag], draining a batch first if
+ * it is full. Caller holds the magazine lock. */
+static void put_cached(int i, struct magazine_t * mag) {
+	_mem_stat[i].refs = 0;
+	_mem_stat[i].proc = 0;
+	_mem_stat[i].owner = NULL;
+	if (mag->nr == MAG_SIZE) {
+		drain_magazine(mag, MAG_BATCH);
+	}
+	mag->frames[mag->nr++] = i;
+	__atomic_add_fetch(&_cached_frames, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&_nr_freed, 1, __ATOMIC_RELAXED);
+}
+
+/* Return 1 if the region of [proc] at [address] has at most MAG_BATCH
+ * pages, all in frames no other process maps. The count of a frame only
+ * drops behind the back of [proc], so such a region stays private. */
+static int private_region(addr_t address, struct pcb_t * proc) {
+	struct pte_t entry;
+	int num_pages = 0;
+	if (!get_entry(address, proc, &entry)) {
+		return 0;
+	}
+	do {
+		if (!entry.present || _mem_stat[entry.p_index].shm ||
+				__atomic_load_n(&_mem_stat[entry.p_index].refs,
+					__ATOMIC_ACQUIRE) != 1 ||
+				++num_pages > MAG_BATCH) {
+			return 0;
+		}
+	} while (get_entry(address + num_pages * PAGE_SIZE, proc, &entry) &&
+		!entry.head);
+	return 1;
+}
+
+/* Release the pages of the region of [proc] which starts at [address],
+ * resident or not, up to the head of the next region. If the region is a
+ * shared memory segment, detach [proc] from it. Frames go to magazine
+ * [mag] if it is not NULL, which only private regions may do and under
+ * the magazine lock, or back to the frame map under [mem_lock]
+ * otherwise. Return the number of pages released. */
+static int release_region(addr_t address, struct pcb_t * proc,
+		struct magazine_t * mag) {
+	struct pte_t entry;
+	int num_pages = 0;
+	if (!get_entry(address, proc, &entry)) {
+		return 0;
+	}
+	int shm = entry.present ? _mem_stat[entry.p_index].shm : 0;
+	flush_tlb(proc);
+	do {
+		addr_t addr = address + num_pages * PAGE_SIZE;
+		struct seg_entry_t * seg =
+			&proc->seg_table->table[get_first_lv(addr)];
+		if (seg->large && get_second_lv(addr) == 0) {
+			/* The region covers the whole large page */
+			int j;
+			for (j = 0; j < (1 << PAGE_LEN); j++) {
+				if (mag != NULL) {
+					put_cached(seg->p_index + j, mag);
+				}else{
+					put_frame(seg->p_index + j, proc);
+				}
+			}
+			seg->large = 0;
+			proc->seg_table->size--;
+			num_pages += 1 << PAGE_LEN;
+		}else{
+			struct pte_t * pte = get_pte(addr, proc);
+			if (mag != NULL) {
+				put_cached(pte->p_index, mag);
+			}else if (pte->present) {
+				put_frame(pte->p_index, proc);
+			}else if (pte->swap) {
+				release_slot(pte->swap - 1);
+			}
+			unmap_page(addr, proc);
+			num_pages++;
+		}
+	} while (get_entry(address + num_pages * PAGE_SIZE, proc, &entry) &&
+		!entry.head);
+	if (shm) {
+		remove_shm_pid(shm - 1, proc->pid);
+	}else if (_demand) {
+		_reserved_pages -= num_pages;
+	}
+	return num_pages;
+}
+
+/* Release the region of [proc] at [address], through the magazine of
+ * its CPU if it is small and private. Return the number of pages
+ * released. */
+static int free_region(addr_t address, struct pcb_t * proc) {
+	struct magazine_t * mag = get_magazine(proc);
+	if (mag != NULL && enter_magazine(mag, proc)) {
+		if (private_region(address, proc)) {
+			int num_pages = release_region(address, proc, mag);
+			mag->nr_frees++;
+			leave_magazine(mag);
+			return num_pages;
+		}
+		leave_magazine(mag);
+	}
+	lock_mem();
+	int num_pages = release_region(address, proc, NULL);
+	unlock_mem();
+	return num_pages;
+}
+
 int free_mem(addr_t address, struct pcb_t * proc) {
 	/*TODO: Release memory region allocated by [proc]. The first byte of
 	  this region is indicated by [address]. Task to do:
@@ -222,81 +1756,399 @@ int free_mem(addr_t address, struct pcb_t * proc) {
 	 * 	- Remember to use lock to protect the memory from other
 	 * 	  processes.  */
 
-	pthread_mutex_lock(&mem_lock);
-	addr_t phy_addr;
-	//printf("ret_mem free: %d\n", get_second_lv(address));
-	if (translate(address, &phy_addr, proc) == 0)
-	{	
-		//printf("ret_mem free: %d\n", get_second_lv(address));
-		pthread_mutex_unlock(&mem_lock);
-		return 0;
+	/* Only the CPU running [proc] uses its lists. An address inside a
+	 * region, or past the break, must not free anything. */
+	if (!remove_region(address, proc)) {
+		return 1;
 	}
+	/* Pages are found through the page tables rather than the list
+	 * in _mem_stat, which does not follow frames copied on write */
+	int num_pages = free_region(address, proc);
+	put_range(address, num_pages, proc);
 
-	int num_pages = 0;
+	return 0;
+}
 
-	for (int i = phy_addr >> OFFSET_LEN; i != -1; i = _mem_stat[i].next)
-	{
-		_mem_stat[i].proc = 0;
-		num_pages++;
+void release_mem(struct pcb_t * proc) {
+	struct region_t * region;
+	for (region = proc->regions; region != NULL; region = region->next) {
+		free_region(region->start, proc);
 	}
+	/* The nodes go away with the arena */
+	proc->regions = NULL;
+}
 
-	int num_seg_entries = num_pages % (1 << PAGE_LEN) ? num_pages / (1 << PAGE_LEN) + 1 : num_pages / (1 << PAGE_LEN);
-	if (address + num_seg_entries * (1 << PAGE_LEN) * PAGE_SIZE == proc->bp)
-		proc->bp = proc->bp - num_seg_entries * (1 << PAGE_LEN) * PAGE_SIZE;
+/* Row of the page table of its owner mapping used frame [i], NULL if the
+ * page cannot be moved: it is shared, in a large page, which is
+ * contiguous already, not mapped by a process at all, or its owner is
+ * changing its tables through a magazine. */
+static struct pte_t * movable_page(int i) {
+	struct mem_stat_t * stat = &_mem_stat[i];
+	struct pcb_t * owner = stat->owner;
+	if (!(_frame_map[i / 64] & (1ULL << (i % 64))) || owner == NULL ||
+			in_magazine(owner) || stat->refs != 1 || stat->shm) {
+		return NULL;
+	}
+	struct seg_entry_t * seg =
+		&stat->owner->seg_table->table[get_first_lv(stat->page)];
+	if (seg->large || seg->pages == NULL) {
+		return NULL;
+	}
+	struct pte_t * pte = &seg->pages->table[get_second_lv(stat->page)];
+	return pte->present && pte->p_index == i ? pte : NULL;
+}
 
-	int curr_seg_entry = 0;
-	while (curr_seg_entry < num_seg_entries)
-	{
-		int vir_first_lv = get_first_lv(address);
-		struct page_table_t *page_table = get_page_table(vir_first_lv, proc->seg_table);
-		free(page_table);
-		for (int i = 0; i < proc->seg_table->size; i++)
-		{
-			if (proc->seg_table->table[i].v_index == vir_first_lv)
-			{
-				for (int j = i; j < proc->seg_table->size - 1; j++)
-				{
-					proc->seg_table->table[j].pages = proc->seg_table->table[j + 1].pages;
-					proc->seg_table->table[j].v_index = proc->seg_table->table[j + 1].v_index;
-				}
+/* Move the page in frame [i], mapped by row [pte] of its owner, to free
+ * frame [j]. Like evict_frame(), the row changes and the generation of
+ * the owner is bumped under the lock of the old frame, so that reads and
+ * writes in flight retry and find the new frame. */
+static void move_page(int i, int j, struct pte_t * pte) {
+	struct mem_stat_t * stat = &_mem_stat[i];
+	struct pte_t prev;
+	/* Keep the list of frames of the region in order */
+	if (stat->index > 0 && get_entry(stat->page - PAGE_SIZE, stat->owner,
+			&prev) && prev.present &&
+			_mem_stat[prev.p_index].next == i) {
+		_mem_stat[prev.p_index].next = j;
+	}
+	_frame_map[j / 64] |= 1ULL << (j % 64);
+	_used_frames++;
+	_mem_stat[j] = *stat;
+	pthread_mutex_t * lock = get_frame_lock(i << OFFSET_LEN);
+	pthread_mutex_lock(lock);
+	memcpy(&_ram[j << OFFSET_LEN], &_ram[i << OFFSET_LEN], PAGE_SIZE);
+	pte->p_index = j;
+	flush_tlb(stat->owner);
+	pthread_mutex_unlock(lock);
+	if (_demand) {
+		_referenced[j] = _referenced[i];
+		_age[j] = _age[i];
+	}
+	stat->proc = 0;
+	stat->refs = 0;
+	stat->owner = NULL;
+	release_frame(i);
+}
 
-				proc->seg_table->table[proc->seg_table->size - 1].pages = NULL;
-				proc->seg_table->size--;
-				break;
-			}
+/* Give used frame [i] back to the frame map if it is cached in a
+ * magazine not in use, so that a page can move to it. Return 1 if it
+ * was given back. Caller holds [mem_lock]. */
+static int uncache_frame(int i) {
+	if (_mem_stat[i].owner != NULL || _mem_stat[i].refs != 0 ||
+			_mem_stat[i].shm) {
+		return 0;
+	}
+	int m;
+	for (m = 0; m < _nr_mag; m++) {
+		struct magazine_t * mag = &_mag[m];
+		if (pthread_mutex_trylock(&mag->lock) != 0) {
+			continue;
 		}
+		int k;
+		for (k = 0; k < mag->nr && mag->frames[k] != i; k++);
+		if (k < mag->nr) {
+			mag->frames[k] = mag->frames[--mag->nr];
+			release_frame(i);
+			__atomic_sub_fetch(&_cached_frames, 1, __ATOMIC_RELAXED);
+			mag->nr_drains++;
+			pthread_mutex_unlock(&mag->lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&mag->lock);
+	}
+	return 0;
+}
 
-		curr_seg_entry++;
-		address = address + curr_seg_entry * (1 << PAGE_LEN) * PAGE_SIZE;
+int compact_mem(int max_pages) {
+	/* The buddy system keeps its free blocks merged by itself */
+	if (_buddy || (!__atomic_load_n(&_compacting, __ATOMIC_RELAXED) &&
+			__atomic_load_n(&_nr_freed, __ATOMIC_RELAXED) == _freed_mark)) {
+		return 0;
 	}
+	lock_mem();
+	if (!_compacting) {
+		_freed_mark = __atomic_load_n(&_nr_freed, __ATOMIC_RELAXED);
+		_free_scan = _first_free_word * 64;
+		_move_scan = NUM_PAGES - 1;
+		/* Magazines change tables without [mem_lock]. From now on
+		 * they are bypassed, see enter_magazine(). */
+		__atomic_store_n(&_compacting, 1, __ATOMIC_SEQ_CST);
+		_nr_passes++;
+	}
+	int moved = 0;
+	while (moved < max_pages) {
+		struct pte_t * pte = NULL;
+		while (_move_scan > _free_scan &&
+				(pte = movable_page(_move_scan)) == NULL) {
+			_move_scan--;
+		}
+		while (_free_scan < _move_scan &&
+				(_frame_map[_free_scan / 64] &
+					(1ULL << (_free_scan % 64))) &&
+				!uncache_frame(_free_scan)) {
+			_free_scan++;
+		}
+		if (_free_scan >= _move_scan) {
+			__atomic_store_n(&_compacting, 0, __ATOMIC_RELEASE);
+			break;
+		}
+		move_page(_move_scan, _free_scan, pte);
+		moved++;
+	}
+	_nr_moved += moved;
+	unlock_mem();
+	return moved;
+}
 
-	pthread_mutex_unlock(&mem_lock);
+int get_shm(uint32_t key, uint32_t size) {
+	lock_mem();
+	int num_pages = (size % PAGE_SIZE) ? size / PAGE_SIZE + 1 :
+		size / PAGE_SIZE;
+	int id = -1;
+	int i;
+	for (i = 0; i < MAX_SHM; i++) {
+		if (_shm[i].num_pages != 0 && _shm[i].key == key) {
+			break;
+		}
+	}
+	if (i < MAX_SHM) {
+		/* The segment exists, it must be large enough */
+		if (num_pages <= _shm[i].num_pages) {
+			id = i;
+		}
+	}else if (num_pages > 0) {
+		for (i = 0; i < MAX_SHM && _shm[i].num_pages != 0; i++);
+		if (i < MAX_SHM) {
+			_shm[i].key = key;
+			_shm[i].num_pages = num_pages;
+			_shm[i].first = -1;
+			_shm[i].nr_frames = 0;
+			_shm[i].nr_attached = 0;
+			id = i;
+		}
+	}
+	unlock_mem();
+	return id;
+}
 
-	return 0;
+addr_t attach_shm(int id, struct pcb_t * proc) {
+	lock_mem();
+	if (id < 0 || id >= MAX_SHM || _shm[id].num_pages == 0) {
+		unlock_mem();
+		return 0;
+	}
+	struct shm_t * shm = &_shm[id];
+	int num_pages = shm->num_pages;
+	addr_t ret_mem = take_range(num_pages, proc);
+	int mem_avail = ret_mem != 0;
+	if (mem_avail && shm->first == -1) {
+		/* First attachment, the segment needs frames. With demand
+		 * paging they are taken away from pageable memory, which must
+		 * keep a frame and still back every reserved page. */
+		mem_avail = reserve_frames(num_pages) &&
+			(!_buddy || buddy_fits(num_pages));
+		if (_demand) {
+			mem_avail = mem_avail &&
+				_shm_frames + num_pages < NUM_PAGES &&
+				_reserved_pages <= NUM_PAGES - _shm_frames -
+					num_pages + SWAP_PAGES - 1;
+		}
+		if (mem_avail) {
+			shm->first = take_frames(num_pages, proc->pid);
+			shm->nr_frames = num_pages;
+			_shm_frames += num_pages;
+			int i;
+			for (i = shm->first; i != -1; i = _mem_stat[i].next) {
+				_mem_stat[i].shm = id + 1;
+			}
+		}
+	}
+	if (!mem_avail) {
+		if (ret_mem != 0) {
+			put_range(ret_mem, num_pages, proc);
+		}
+		unlock_mem();
+		return 0;
+	}
+
+	int curr_page = 0;
+	int i;
+	for (i = shm->first; i != -1; i = _mem_stat[i].next) {
+		addr_t addr = ret_mem + curr_page * PAGE_SIZE;
+		map_page(addr, i, curr_page == 0, proc);
+		get_pte(addr, proc)->present = 1;
+		_mem_stat[i].refs++;
+		curr_page++;
+	}
+	add_shm_pid(id, proc->pid);
+	add_region(ret_mem, proc);
+	unlock_mem();
+	return ret_mem;
 }
 
 int read_mem(addr_t address, struct pcb_t * proc, BYTE * data) {
 	addr_t physical_addr;
-	if (translate(address, &physical_addr, proc)) {
-		pthread_mutex_lock(&mem_lock);
-		*data = _ram[physical_addr];
-		pthread_mutex_unlock(&mem_lock);
-		return 0;
-	}else{
-		return 1;
+	while (1) {
+		uint32_t gen = map_gen(proc);
+		if (!translate(address, &physical_addr, proc)) {
+			return 1;
+		}
+		*data = __atomic_load_n(&_ram[physical_addr], __ATOMIC_RELAXED);
+		/* Order the read of the byte before the generation check */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (map_gen(proc) == gen) {
+			return 0;
+		}
 	}
 }
 
 int write_mem(addr_t address, struct pcb_t * proc, BYTE data) {
 	addr_t physical_addr;
-	if (translate(address, &physical_addr, proc)) {
-		pthread_mutex_lock(&mem_lock);
-		_ram[physical_addr] = data;
-		pthread_mutex_unlock(&mem_lock);
+	while (1) {
+		uint32_t gen = map_gen(proc);
+		if (!translate(address, &physical_addr, proc)) {
+			return 1;
+		}
+		pthread_mutex_t * lock = get_frame_lock(physical_addr);
+		pthread_mutex_lock(lock);
+		int mapped = (map_gen(proc) == gen);
+		int shared = mapped && cow_frame(physical_addr >> OFFSET_LEN);
+		if (mapped && !shared) {
+			_ram[physical_addr] = data;
+		}
+		pthread_mutex_unlock(lock);
+		if (shared && unshare_page(address, proc)) {
+			return 1;
+		}else if (mapped && !shared) {
+			return 0;
+		}
+	}
+}
+
+/* Return 1 if every byte of [size] bytes at [address] belongs to an
+ * allocated region, whether its page is in memory or not. An empty block
+ * is valid only if [address] itself is. */
+static int valid_range(addr_t address, uint32_t size, struct pcb_t * proc) {
+	if (address + size < address) {
 		return 0;
-	}else{
+	}
+	addr_t page = address - get_offset(address);
+	do {
+		struct pte_t entry;
+		if (!get_entry(page, proc, &entry)) {
+			return 0;
+		}
+		page += PAGE_SIZE;
+	} while (page < address + size);
+	return 1;
+}
+
+/* Give [proc] its own copy of every shared frame of the block of [size]
+ * bytes at [address], so the block can be written. Return 1 if memory
+ * runs out, 0 otherwise. Caller makes sure the block is valid. */
+static int unshare_range(addr_t address, uint32_t size, struct pcb_t * proc) {
+	addr_t page = address - get_offset(address);
+	for (; page < address + size; page += PAGE_SIZE) {
+		if (unshare_page(page, proc)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Block accesses move a page-contiguous run at a time, with one
+ * translation per run and the same locking as byte accesses. [data] is
+ * the source of a write, or NULL to fill the block with [fill]. Caller
+ * makes sure the block is valid and not shared. */
+static void write_block(addr_t address, struct pcb_t * proc,
+		const BYTE * data, BYTE fill, uint32_t size) {
+	while (size > 0) {
+		uint32_t gen = map_gen(proc);
+		addr_t physical_addr;
+		translate(address, &physical_addr, proc);
+		uint32_t len = PAGE_SIZE - get_offset(address);
+		if (len > size) {
+			len = size;
+		}
+		pthread_mutex_t * lock = get_frame_lock(physical_addr);
+		pthread_mutex_lock(lock);
+		int mapped = (map_gen(proc) == gen);
+		if (mapped && data != NULL) {
+			memcpy(&_ram[physical_addr], data, len);
+		}else if (mapped) {
+			memset(&_ram[physical_addr], fill, len);
+		}
+		pthread_mutex_unlock(lock);
+		if (mapped) {
+			address += len;
+			size -= len;
+			if (data != NULL) {
+				data += len;
+			}
+		}
+	}
+}
+
+static void read_block(addr_t address, struct pcb_t * proc,
+		BYTE * data, uint32_t size) {
+	while (size > 0) {
+		uint32_t gen = map_gen(proc);
+		addr_t physical_addr;
+		translate(address, &physical_addr, proc);
+		uint32_t len = PAGE_SIZE - get_offset(address);
+		/* Reads take no lock, so a run may go on over the following
+		 * pages as long as they are in memory in contiguous frames */
+		addr_t next;
+		while (len < size &&
+				lookup(address + len, &next, proc) &&
+				next == physical_addr + len) {
+			len += PAGE_SIZE;
+		}
+		if (len > size) {
+			len = size;
+		}
+		memcpy(data, &_ram[physical_addr], len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (map_gen(proc) == gen) {
+			address += len;
+			size -= len;
+			data += len;
+		}
+	}
+}
+
+int fill_mem(addr_t address, struct pcb_t * proc, BYTE data, uint32_t size) {
+	if (!valid_range(address, size, proc) ||
+			unshare_range(address, size, proc)) {
 		return 1;
 	}
+	write_block(address, proc, NULL, data, size);
+	return 0;
+}
+
+/* Bytes moved per step of copy_mem */
+#define COPY_CHUNK	4096
+
+int copy_mem(addr_t source, addr_t destination, struct pcb_t * proc,
+		uint32_t size) {
+	if (!valid_range(source, size, proc) ||
+			!valid_range(destination, size, proc) ||
+			unshare_range(destination, size, proc)) {
+		return 1;
+	}
+	/* Copy from the end if the destination overlaps the tail of the
+	 * source, so source bytes are read before being overwritten */
+	int backward = source < destination && destination - source < size;
+	BYTE buf[COPY_CHUNK];
+	uint32_t done = 0;
+	while (done < size) {
+		uint32_t len = size - done < COPY_CHUNK ? size - done : COPY_CHUNK;
+		uint32_t offset = backward ? size - done - len : done;
+		read_block(source + offset, proc, buf, len);
+		write_block(destination + offset, proc, buf, 0, len);
+		done += len;
+	}
+	return 0;
 }
 
 void dump(void) {
@@ -304,16 +2156,27 @@ void dump(void) {
 	for (i = 0; i < NUM_PAGES; i++) {
 		if (_mem_stat[i].proc != 0) {
 			printf("%03d: ", i);
-			printf("%05x-%05x - PID: %02d (idx %03d, nxt: %03d)\n",
+			printf("%05x-%05x - PID: %02d (idx %03d, nxt: %03d)",
 				i << OFFSET_LEN,
-				((i + 1) << OFFSET_LEN) - 1,
+				(i << OFFSET_LEN) + (PAGE_SIZE - 1),
 				_mem_stat[i].proc,
 				_mem_stat[i].index,
 				_mem_stat[i].next
 			);
+			if (_mem_stat[i].shm) {
+				struct shm_t * shm = &_shm[_mem_stat[i].shm - 1];
+				printf(" shm %d, PIDs:", _mem_stat[i].shm - 1);
+				int k;
+				for (k = 0; k < shm->nr_attached; k++) {
+					printf(" %02d", shm->pids[k]);
+				}
+			}else if (_mem_stat[i].refs > 1) {
+				printf(" shared by %d", _mem_stat[i].refs);
+			}
+			printf("\n");
 			int j;
 			for (	j = i << OFFSET_LEN;
-				j < ((i+1) << OFFSET_LEN) - 1;
+				j < (i << OFFSET_LEN) + (PAGE_SIZE - 1);
 				j++) {
 				
 				if (_ram[j] != 0) {
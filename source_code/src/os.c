@@ -4,111 +4,294 @@
 #include "sched.h"
 #include "loader.h"
 #include "mem.h"
+#include "arena.h"
 
 #include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
 static int time_slot;
 static int num_cpus;
 static int done = 0;
+static int cpus_live;	// CPUs which have not stopped, changed atomically
+static int compact_pages;	// Pages the compactor may move in a slot,
+				// 0 if there is no compactor
+
+/* Memory geometry given by the options, or else by the config. 0 keeps
+ * the default. */
+static uint64_t ram_size;
+static int segment_len;
+static int page_len;
+static int offset_len;
 
 static struct ld_args{
 	char ** path;
 	unsigned long * start_time;
+	int next;		// Index of the next process to be loaded
+	struct pcb_t * proc;	// Loaded process waiting for its start time
 } ld_processes;
 int num_processes;
 
 struct cpu_args {
 	struct timer_id_t * timer_id;
 	int id;
+	int time_left;
+	struct pcb_t * proc;	// Process currently running on the CPU
+};
+
+/* What a device did in the current time slot */
+enum dev_stat_t {
+	DEV_BUSY,	// Did some work, must be scheduled in the next slot
+	DEV_IDLE,	// Has nothing to do until its wake-up slot
+	DEV_STOP	// Has finished, never scheduled again
 };
 
+/* Do the job of CPU [cpu] in the current time slot */
+static enum dev_stat_t cpu_step(struct cpu_args * cpu, uint64_t * wake) {
+	int id = cpu->id;
+	struct pcb_t * proc = cpu->proc;
+	/* Check the status of current process */
+	if (proc == NULL) {
+		/* No process is running, the we load new process from
+		 * ready queue */
+		proc = get_proc(id);
+	}else if (proc->pc == proc->code->size) {
+		/* The porcess has finish it job */
+		printf("\tCPU %d: Processed %2d has finished\n",
+			id ,proc->pid);
+		free_proc(proc);
+		proc = get_proc(id);
+		cpu->time_left = 0;
+	}else if (cpu->time_left == 0) {
+		/* The process has done its job in current time slot */
+		printf("\tCPU %d: Put process %2d to run queue\n",
+			id, proc->pid);
+		put_proc(proc, id);
+		proc = get_proc(id);
+	}
+	cpu->proc = proc;
+
+	/* Recheck process status after loading new process */
+	if (proc == NULL && done) {
+		/* No process to run, exit */
+		printf("\tCPU %d stopped\n", id);
+		__atomic_sub_fetch(&cpus_live, 1, __ATOMIC_RELEASE);
+		return DEV_STOP;
+	}else if (proc == NULL) {
+		/* There may be new processes to run in
+		 * next time slots, just skip current slot */
+		*wake = IDLE_FOREVER;
+		return DEV_IDLE;
+	}else if (cpu->time_left == 0) {
+		printf("\tCPU %d: Dispatched process %2d\n",
+			id, proc->pid);
+		cpu->time_left = time_slot;
+	}
+
+	/* Run current process */
+	run(proc);
+	cpu->time_left--;
+	return DEV_BUSY;
+}
+
+/* Do the job of the loader in the current time slot */
+static enum dev_stat_t ld_step(uint64_t * wake) {
+	int i = ld_processes.next;
+	if (i == num_processes) {
+		free(ld_processes.path);
+		free(ld_processes.start_time);
+		done = 1;
+		return DEV_STOP;
+	}
+	if (ld_processes.proc == NULL) {
+		ld_processes.proc = load(ld_processes.path[i]);
+	}
+	if (current_time() < ld_processes.start_time[i]) {
+		*wake = ld_processes.start_time[i];
+		return DEV_IDLE;
+	}
+	printf("\tLoaded a process at %s, PID: %d\n",
+		ld_processes.path[i], ld_processes.proc->pid);
+	add_proc(ld_processes.proc);
+	free(ld_processes.path[i]);
+	ld_processes.proc = NULL;
+	ld_processes.next++;
+	return DEV_BUSY;
+}
+
+/* Do the job of the compactor in the current time slot. It has work
+ * whenever processes free memory, so it runs for as long as the CPUs. */
+static enum dev_stat_t compact_step(uint64_t * wake) {
+	if (__atomic_load_n(&cpus_live, __ATOMIC_ACQUIRE) == 0) {
+		return DEV_STOP;
+	}
+	int moved = compact_mem(compact_pages);
+	if (moved == 0) {
+		*wake = IDLE_FOREVER;
+		return DEV_IDLE;
+	}
+	printf("\tCompactor: Moved %d pages\n", moved);
+	return DEV_BUSY;
+}
+
 static void * cpu_routine(void * args) {
-	struct timer_id_t * timer_id = ((struct cpu_args*)args)->timer_id;
-	int id = ((struct cpu_args*)args)->id;
-	/* Check for new process in ready queue */
-	int time_left = 0;
-	struct pcb_t * proc = NULL;
-	while (1) {
-		/* Check the status of current process */
-		if (proc == NULL) {
-			/* No process is running, the we load new process from
-		 	* ready queue */
-			proc = get_proc();
-		}else if (proc->pc == proc->code->size) {
-			/* The porcess has finish it job */
-			printf("\tCPU %d: Processed %2d has finished\n",
-				id ,proc->pid);
-			free(proc);
-			proc = get_proc();
-			time_left = 0;
-		}else if (time_left == 0) {
-			/* The process has done its job in current time slot */
-			printf("\tCPU %d: Put process %2d to run queue\n",
-				id, proc->pid);
-			put_proc(proc);
-			proc = get_proc();
+	struct cpu_args * cpu = (struct cpu_args*)args;
+	uint64_t wake;
+	enum dev_stat_t stat;
+	while ((stat = cpu_step(cpu, &wake)) != DEV_STOP) {
+		if (stat == DEV_IDLE) {
+			idle_slot(cpu->timer_id, wake);
+		}else{
+			next_slot(cpu->timer_id);
 		}
-		
-		/* Recheck process status after loading new process */
-		if (proc == NULL && done) {
-			/* No process to run, exit */
-			printf("\tCPU %d stopped\n", id);
-			break;
-		}else if (proc == NULL) {
-			/* There may be new processes to run in
-			 * next time slots, just skip current slot */
+	}
+	detach_event(cpu->timer_id);
+	pthread_exit(NULL);
+}
+
+static void * ld_routine(void * args) {
+	struct timer_id_t * timer_id = (struct timer_id_t*)args;
+	uint64_t wake;
+	enum dev_stat_t stat;
+	while ((stat = ld_step(&wake)) != DEV_STOP) {
+		if (stat == DEV_IDLE) {
+			idle_slot(timer_id, wake);
+		}else{
 			next_slot(timer_id);
-			continue;
-		}else if (time_left == 0) {
-			printf("\tCPU %d: Dispatched process %2d\n",
-				id, proc->pid);
-			time_left = time_slot;
 		}
-		
-		/* Run current process */
-		run(proc);
-		time_left--;
-		next_slot(timer_id);
 	}
 	detach_event(timer_id);
 	pthread_exit(NULL);
 }
 
-static void * ld_routine(void * args) {
+static void * compact_routine(void * args) {
 	struct timer_id_t * timer_id = (struct timer_id_t*)args;
-	int i = 0;
-	while (i < num_processes) {
-		struct pcb_t * proc = load(ld_processes.path[i]);
-		while (current_time() < ld_processes.start_time[i]) {
+	uint64_t wake;
+	enum dev_stat_t stat;
+	while ((stat = compact_step(&wake)) != DEV_STOP) {
+		if (stat == DEV_IDLE) {
+			idle_slot(timer_id, wake);
+		}else{
 			next_slot(timer_id);
 		}
-		printf("\tLoaded a process at %s, PID: %d\n",
-			ld_processes.path[i], proc->pid);
-		add_proc(proc);
-		free(ld_processes.path[i]);
-		i++;
-		next_slot(timer_id);
-	}
-	free(ld_processes.path);
-	free(ld_processes.start_time);
-	done = 1;
+	}
 	detach_event(timer_id);
 	pthread_exit(NULL);
 }
 
+/* Single-threaded discrete-event engine. In every time slot the CPUs do
+ * their job in the order of their IDs, then the loader and the compactor
+ * do their own. If no device did any work, nothing can change before the
+ * earliest wake-up slot so the clock jumps straight to it. The output
+ * only depends on the configuration. */
+static void run_events(struct cpu_args * cpus) {
+	int * stopped = (int*)calloc(num_cpus, sizeof(int));
+	int ld_stopped = 0;
+	int compact_stopped = (compact_pages == 0);
+	int live = num_cpus + 1 + !compact_stopped;
+	while (live > 0) {
+		begin_slot();
+		int busy = 0;
+		uint64_t wake_min = IDLE_FOREVER;
+		int i;
+		for (i = 0; i <= num_cpus + 1; i++) {
+			uint64_t wake = IDLE_FOREVER;
+			enum dev_stat_t stat;
+			if (i < num_cpus) {
+				if (stopped[i]) {
+					continue;
+				}
+				stat = cpu_step(&cpus[i], &wake);
+				if (stat == DEV_STOP) {
+					stopped[i] = 1;
+				}
+			}else if (i == num_cpus) {
+				if (ld_stopped) {
+					continue;
+				}
+				stat = ld_step(&wake);
+				if (stat == DEV_STOP) {
+					ld_stopped = 1;
+				}
+			}else{
+				if (compact_stopped) {
+					continue;
+				}
+				stat = compact_step(&wake);
+				if (stat == DEV_STOP) {
+					compact_stopped = 1;
+				}
+			}
+			if (stat == DEV_STOP) {
+				live--;
+			}else if (stat == DEV_BUSY) {
+				busy = 1;
+			}else if (wake < wake_min) {
+				wake_min = wake;
+			}
+		}
+		uint64_t next = current_time() + 1;
+		if (!busy && wake_min != IDLE_FOREVER && wake_min > next) {
+			next = wake_min;
+		}
+		end_slot(next);
+	}
+	free(stopped);
+}
+
+/* Read a size in bytes, which may end with K, M or G. Return 0 if it is
+ * not a size. */
+static uint64_t parse_size(const char * str) {
+	char * end;
+	uint64_t size = strtoull(str, &end, 10);
+	switch (*end) {
+	case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'K':
+		size <<= 10;
+		end++;
+		break;
+	}
+	return *end == '\0' ? size : 0;
+}
+
 static void read_config(const char * path) {
 	FILE * file;
 	if ((file = fopen(path, "r")) == NULL) {
 		printf("Cannot find configure file at %s\n", path);
 		exit(1);
 	}
-	fscanf(file, "%d %d %d\n", &time_slot, &num_cpus, &num_processes);
+	/* The first line may go on with the size of RAM and the number of
+	 * bits of the segment index, page index and offset */
+	char line[256];
+	char ram[32];
+	int seg, page, off;
+	if (fgets(line, sizeof(line), file) == NULL) {
+		printf("Cannot read configure file at %s\n", path);
+		exit(1);
+	}
+	int n = sscanf(line, "%d %d %d %31s %d %d %d", &time_slot, &num_cpus,
+		&num_processes, ram, &seg, &page, &off);
+	if (n >= 4 && ram_size == 0) {
+		ram_size = parse_size(ram);
+	}
+	if (n == 7 && segment_len == 0) {
+		segment_len = seg;
+		page_len = page;
+		offset_len = off;
+	}
 	ld_processes.path = (char**)malloc(sizeof(char*) * num_processes);
 	ld_processes.start_time = (unsigned long*)
 		malloc(sizeof(unsigned long) * num_processes);
+	ld_processes.next = 0;
+	ld_processes.proc = NULL;
 	int i;
 	for (i = 0; i < num_processes; i++) {
 		ld_processes.path[i] = (char*)malloc(sizeof(char) * 100);
@@ -120,54 +303,177 @@ static void read_config(const char * path) {
 	}
 }
 
+static void usage(void) {
+	printf("Usage: os [-a] [-b] [-c PAGES] [-d] [-e] [-f] [-g SEG,PAGE,OFFSET] [-l]\n\t  [-m RAM] [-o] [-p] [-r] [-v] [path to configure file]\n");
+	printf("\t-a\tprefer dispatching a process on the CPU it last ran on\n");
+	printf("\t-b\tallocate physical frames with a buddy system\n");
+	printf("\t-c\tcompact memory in the background, moving up to PAGES pages a slot\n");
+	printf("\t-d\tpage on demand, swapping out pages with the clock algorithm\n");
+	printf("\t-e\trun every CPU, the loader and the compactor in a single thread\n");
+	printf("\t-f\tfast-forward over time slots in which every CPU is idle\n");
+	printf("\t-g\tsplit addresses into SEG, PAGE and OFFSET bits (default 5,5,10)\n");
+	printf("\t-l\tlike -d, but swap out the least recently used page by aging\n");
+	printf("\t-m\tuse RAM bytes of physical memory, K, M or G suffix (default 1M)\n");
+	printf("\t-o\tuse O(1) bitmap priority arrays as ready/run queues\n");
+	printf("\t-p\tgive each CPU its own ready/run queues\n");
+	printf("\t-r\tround robin through a lock-free queue, ignore -o and -p\n");
+	printf("\t-v\tprint statistics at the end\n");
+}
+
 int main(int argc, char * argv[]) {
-	/* Read config */
-	if (argc != 2) {
-		printf("Usage: os [path to configure file]\n");
+	/* Read options and config */
+	int events = 0;
+	int policy = 0;
+	int verbose = 0;
+	int mem_flags = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "abc:defg:lm:oprv")) != -1) {
+		switch (opt) {
+		case 'a':
+			policy |= POLICY_AFFINE;
+			break;
+		case 'b':
+			mem_flags |= MEM_BUDDY;
+			break;
+		case 'c':
+			if ((compact_pages = atoi(optarg)) <= 0) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'd':
+			mem_flags |= MEM_DEMAND;
+			break;
+		case 'e':
+			events = 1;
+			break;
+		case 'f':
+			set_fast_forward(1);
+			break;
+		case 'g':
+			if (sscanf(optarg, "%d,%d,%d", &segment_len, &page_len,
+					&offset_len) != 3) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'l':
+			mem_flags |= MEM_DEMAND | MEM_AGING;
+			break;
+		case 'm':
+			if ((ram_size = parse_size(optarg)) == 0) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'o':
+			policy |= POLICY_O1;
+			break;
+		case 'p':
+			policy |= POLICY_PERCPU;
+			break;
+		case 'r':
+			policy |= POLICY_RR;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
 		return 1;
 	}
 	char path[100];
 	path[0] = '\0';
 	strcat(path, "input/");
-	strcat(path, argv[1]);
+	strcat(path, argv[optind]);
 	read_config(path);
 
-	pthread_t * cpu = (pthread_t*)malloc(num_cpus * sizeof(pthread_t));
 	struct cpu_args * args =
 		(struct cpu_args*)malloc(sizeof(struct cpu_args) * num_cpus);
-	pthread_t ld;
-	
-	/* Init timer */
+	cpus_live = num_cpus;
 	int i;
 	for (i = 0; i < num_cpus; i++) {
-		args[i].timer_id = attach_event();
 		args[i].id = i;
+		args[i].time_left = 0;
+		args[i].proc = NULL;
 	}
-	struct timer_id_t * ld_event = attach_event();
-	start_timer();
-
-	/* Init scheduler */
-	init_scheduler();
 
-	/* Run CPU and loader */
-	pthread_create(&ld, NULL, ld_routine, (void*)ld_event);
-	for (i = 0; i < num_cpus; i++) {
-		pthread_create(&cpu[i], NULL,
-			cpu_routine, (void*)&args[i]);
+	if ((ram_size != 0 || segment_len != 0) && set_geometry(
+			ram_size ? ram_size : RAM_SIZE,
+			segment_len ? segment_len : SEGMENT_LEN,
+			page_len ? page_len : PAGE_LEN,
+			offset_len ? offset_len : OFFSET_LEN)) {
+		printf("Unsupported memory geometry\n");
+		return 1;
 	}
 
-	/* Wait for CPU and loader finishing */
-	for (i = 0; i < num_cpus; i++) {
-		pthread_join(cpu[i], NULL);
-	}
-	pthread_join(ld, NULL);
+	/* Init memory, scheduler and per-CPU TLBs */
+	init_mem(mem_flags);
+	init_scheduler(policy, num_cpus);
+	init_tlb(num_cpus);
+
+	if (events) {
+		run_events(args);
+	}else{
+		pthread_t * cpu = (pthread_t*)malloc(num_cpus * sizeof(pthread_t));
+		pthread_t ld;
+		pthread_t compactor;
+
+		/* Init timer */
+		for (i = 0; i < num_cpus; i++) {
+			args[i].timer_id = attach_event();
+		}
+		struct timer_id_t * ld_event = attach_event();
+		struct timer_id_t * compact_event =
+			compact_pages ? attach_event() : NULL;
+		start_timer();
 
-	/* Stop timer */
-	stop_timer();
+		/* Run CPU, loader and compactor */
+		pthread_create(&ld, NULL, ld_routine, (void*)ld_event);
+		if (compact_event != NULL) {
+			pthread_create(&compactor, NULL, compact_routine,
+				(void*)compact_event);
+		}
+		for (i = 0; i < num_cpus; i++) {
+			pthread_create(&cpu[i], NULL,
+				cpu_routine, (void*)&args[i]);
+		}
+
+		/* Wait for CPU, loader and compactor finishing */
+		for (i = 0; i < num_cpus; i++) {
+			pthread_join(cpu[i], NULL);
+		}
+		pthread_join(ld, NULL);
+		if (compact_event != NULL) {
+			pthread_join(compactor, NULL);
+		}
+
+		/* Stop timer */
+		stop_timer();
+		free(cpu);
+	}
+	free(args);
 
 	printf("\nMEMORY CONTENT: \n");
 	dump();
 
+	if (verbose) {
+		printf("\nSCHEDULER STATISTICS: \n");
+		sched_stats();
+		printf("\nMEMORY STATISTICS: \n");
+		mem_stats();
+		arena_stats();
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		printf("Peak RSS: %ld KiB\n", usage.ru_maxrss);
+	}
+	finish_scheduler();
+
 	return 0;
 
 }
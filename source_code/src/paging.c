@@ -2,6 +2,7 @@
 #include "mem.h"
 #include "cpu.h"
 #include "loader.h"
+#include "sched.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -10,10 +11,15 @@ int main(int argc, char ** argv) {
 		printf("Cannot find input process\n");
 		exit(1);
 	}
+	init_mem(0);
+	init_scheduler(0, 1);
 	struct pcb_t * proc = load(argv[1]);
-	unsigned int i;
-	for (i = 0; i < proc->code->size; i++) {
-		run(proc);
+	/* Run the process, then every process it forked, one by one */
+	while (proc != NULL) {
+		while (proc->pc < proc->code->size) {
+			run(proc);
+		}
+		proc = get_proc(0);
 	}
 	dump();
 	return 0;
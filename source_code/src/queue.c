@@ -1,16 +1,128 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "queue.h"
 
 int empty(struct queue_t * q) {
 	return (q->size == 0);
 }
 
+/* Return 1 if node [a] must leave the queue before node [b] */
+static int before(struct queue_node_t * a, struct queue_node_t * b) {
+	if (a->proc->priority != b->proc->priority) {
+		return a->proc->priority > b->proc->priority;
+	}
+	return a->seq < b->seq;
+}
+
+static void swap(struct queue_node_t * a, struct queue_node_t * b) {
+	struct queue_node_t tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+void init_prio_array(struct queue_t * q) {
+	memset(q, 0, sizeof(struct queue_t));
+	q->prio_array = 1;
+}
+
+static int prio_level(struct pcb_t * proc) {
+	return proc->priority < MAX_PRIO ? proc->priority : MAX_PRIO - 1;
+}
+
+static void prio_array_enqueue(struct queue_t * q, struct pcb_t * proc) {
+	int level = prio_level(proc);
+	proc->next = NULL;
+	if (q->head[level] == NULL) {
+		q->head[level] = proc;
+		q->bitmap[level / 64] |= 1ULL << (level % 64);
+	}else{
+		q->tail[level]->next = proc;
+	}
+	q->tail[level] = proc;
+	q->size++;
+}
+
+/* Highest non-empty level of a priority array */
+static int prio_array_top(struct queue_t * q) {
+	int w = PRIO_WORDS - 1;
+	while (q->bitmap[w] == 0) {
+		w--;
+	}
+	return w * 64 + 63 - __builtin_clzll(q->bitmap[w]);
+}
+
+/* Unlink [proc], which follows [prev] in the list of [level] */
+static void prio_array_unlink(struct queue_t * q, int level,
+		struct pcb_t * prev, struct pcb_t * proc) {
+	if (prev == NULL) {
+		q->head[level] = proc->next;
+	}else{
+		prev->next = proc->next;
+	}
+	if (q->tail[level] == proc) {
+		q->tail[level] = prev;
+	}
+	if (q->head[level] == NULL) {
+		q->bitmap[level / 64] &= ~(1ULL << (level % 64));
+	}
+	proc->next = NULL;
+	q->size--;
+}
+
+static void heap_push(struct queue_t * q, struct queue_node_t node) {
+	if (q->size == q->capacity) {
+		int capacity = q->capacity ? q->capacity * 2 : 16;
+		struct queue_node_t * heap = (struct queue_node_t *)realloc(
+			q->heap, sizeof(struct queue_node_t) * capacity);
+		if (heap == NULL) {
+			printf("Cannot grow queue to %d processes\n", capacity);
+			exit(1);
+		}
+		q->heap = heap;
+		q->capacity = capacity;
+	}
+
+	/* Sift the new node up */
+	int i = q->size++;
+	q->heap[i] = node;
+	while (i > 0 && before(&q->heap[i], &q->heap[(i - 1) / 2])) {
+		swap(&q->heap[i], &q->heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+}
+
+static struct queue_node_t heap_pop(struct queue_t * q) {
+	struct queue_node_t node = q->heap[0];
+	q->size--;
+	q->heap[0] = q->heap[q->size];
+
+	/* Sift the last node down from the root */
+	int i = 0;
+	while (1) {
+		int child = 2 * i + 1;
+		if (child >= q->size) break;
+		if (child + 1 < q->size &&
+				before(&q->heap[child + 1], &q->heap[child])) {
+			child++;
+		}
+		if (!before(&q->heap[child], &q->heap[i])) break;
+		swap(&q->heap[i], &q->heap[child]);
+		i = child;
+	}
+	return node;
+}
+
 void enqueue(struct queue_t * q, struct pcb_t * proc) {
 	/* TODO: put a new process to queue [q] */
-	if (q->size == MAX_QUEUE_SIZE) return;
-	q->proc[q->size] = proc;
-	q->size++;
+	if (q->prio_array) {
+		prio_array_enqueue(q, proc);
+		return;
+	}
+	struct queue_node_t node;
+	node.proc = proc;
+	node.seq = q->seq++;
+	heap_push(q, node);
 }
 
 struct pcb_t * dequeue(struct queue_t * q) {
@@ -18,33 +130,130 @@ struct pcb_t * dequeue(struct queue_t * q) {
 	 * in the queue [q] and remember to remove it from q
 	 * */
 	if (empty(q)) return NULL;
+	if (q->prio_array) {
+		int level = prio_array_top(q);
+		struct pcb_t * proc = q->head[level];
+		prio_array_unlink(q, level, NULL, proc);
+		return proc;
+	}
+	return heap_pop(q).proc;
+}
 
-	//find highest priority proc
-	uint32_t priority_max = q->proc[0]->priority;
-	for (int i = 1; i < q->size; i++)
-	{
-		if (q->proc[i]->priority > priority_max)
-		{
-			priority_max = q->proc[i]->priority;
+struct pcb_t * dequeue_affine(struct queue_t * q, int cpu, int window) {
+	if (empty(q)) return NULL;
+	if (window > MAX_AFFINITY_WINDOW) window = MAX_AFFINITY_WINDOW;
+	if (q->prio_array) {
+		int level = prio_array_top(q);
+		struct pcb_t * prev = NULL;
+		struct pcb_t * proc = q->head[level];
+		int i;
+		for (i = 0; i < window && proc != NULL; i++) {
+			if (proc->cpu == cpu) break;
+			prev = proc;
+			proc = proc->next;
 		}
+		if (proc == NULL || i == window) {
+			prev = NULL;
+			proc = q->head[level];
+		}
+		prio_array_unlink(q, level, prev, proc);
+		return proc;
 	}
 
-	//return highest priority proc
-	for (int i = 0; i < q->size; i++)
-	{
-		if (q->proc[i]->priority == priority_max)
-		{
-			struct pcb_t *return_proc = q->proc[i];
-			q->proc[i] = NULL;
-			for (int j = i; j < q->size - 1; j++)
-				q->proc[j] = q->proc[j + 1];
-			q->proc[q->size - 1] = NULL;
-			q->size--;
-
-			return return_proc;
+	/* Pop the oldest processes of the highest priority until one of
+	 * them last ran on [cpu], then put the others back. They keep their
+	 * sequence numbers, so their FIFO position does not change. */
+	struct queue_node_t nodes[MAX_AFFINITY_WINDOW];
+	uint32_t priority = q->heap[0].proc->priority;
+	int n = 0;
+	int chosen = 0;
+	while (n < window && !empty(q) &&
+			q->heap[0].proc->priority == priority) {
+		nodes[n] = heap_pop(q);
+		if (nodes[n++].proc->cpu == cpu) {
+			chosen = n - 1;
+			break;
+		}
+	}
+	int i;
+	for (i = 0; i < n; i++) {
+		if (i != chosen) {
+			heap_push(q, nodes[i]);
 		}
 	}
+	return nodes[chosen].proc;
+}
 
-	return NULL;
+void init_ring(struct ring_t * r, int capacity) {
+	uint64_t size = 1;
+	while (size < (uint64_t)capacity) {
+		size <<= 1;
+	}
+	memset(r, 0, sizeof(struct ring_t));
+	r->cells = (struct ring_cell_t *)malloc(
+		sizeof(struct ring_cell_t) * size);
+	r->mask = size - 1;
+	uint64_t i;
+	for (i = 0; i < size; i++) {
+		r->cells[i].seq = i;
+		r->cells[i].proc = NULL;
+	}
 }
 
+void free_ring(struct ring_t * r) {
+	free(r->cells);
+	r->cells = NULL;
+}
+
+int ring_enqueue(struct ring_t * r, struct pcb_t * proc) {
+	struct ring_cell_t * cell;
+	uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	while (1) {
+		cell = &r->cells[pos & r->mask];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t dif = (int64_t)(seq - pos);
+		if (dif == 0) {
+			/* The cell is free in this lap, try to claim it */
+			if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+			__atomic_fetch_add(&r->retries, 1, __ATOMIC_RELAXED);
+		}else if (dif < 0) {
+			/* Not drained since the previous lap: full */
+			return 1;
+		}else{
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+		}
+	}
+	cell->proc = proc;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+struct pcb_t * ring_dequeue(struct ring_t * r) {
+	struct ring_cell_t * cell;
+	uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	while (1) {
+		cell = &r->cells[pos & r->mask];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t dif = (int64_t)(seq - (pos + 1));
+		if (dif == 0) {
+			/* The cell has been filled, try to claim it */
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+			__atomic_fetch_add(&r->retries, 1, __ATOMIC_RELAXED);
+		}else if (dif < 0) {
+			/* Not filled yet in this lap: empty */
+			return NULL;
+		}else{
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+	}
+	struct pcb_t * proc = cell->proc;
+	/* Hand the cell over to the producers of the next lap */
+	__atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+	return proc;
+}
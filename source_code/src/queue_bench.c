@@ -0,0 +1,113 @@
+
+#include "queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Throughput of one dequeue plus one enqueue on a queue holding 10, 1k
+ * and 100k processes, for the binary heap, the priority array and the
+ * array scan queue_t used to be. */
+
+#define MIN_SECS	0.2	// Run each case at least this long
+
+/* The queue_t of old, grown to any size: append on enqueue, scan twice
+ * and shift on dequeue */
+struct scan_queue_t {
+	struct pcb_t ** proc;
+	int size;
+};
+
+static void scan_enqueue(struct scan_queue_t * q, struct pcb_t * proc) {
+	q->proc[q->size++] = proc;
+}
+
+static struct pcb_t * scan_dequeue(struct scan_queue_t * q) {
+	uint32_t priority_max = q->proc[0]->priority;
+	int i;
+	for (i = 1; i < q->size; i++) {
+		if (q->proc[i]->priority > priority_max) {
+			priority_max = q->proc[i]->priority;
+		}
+	}
+	for (i = 0; q->proc[i]->priority != priority_max; i++);
+	struct pcb_t * proc = q->proc[i];
+	for (; i < q->size - 1; i++) {
+		q->proc[i] = q->proc[i + 1];
+	}
+	q->size--;
+	return proc;
+}
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Million dequeue/enqueue operations per second on a queue of [n] */
+static double bench(int kind, struct pcb_t * procs, int n) {
+	struct queue_t q;
+	struct scan_queue_t s;
+	int i;
+	if (kind == 1) {
+		init_prio_array(&q);
+	}else{
+		memset(&q, 0, sizeof(q));
+	}
+	s.proc = (struct pcb_t **)malloc(n * sizeof(struct pcb_t *));
+	s.size = 0;
+	for (i = 0; i < n; i++) {
+		if (kind == 2) {
+			scan_enqueue(&s, &procs[i]);
+		}else{
+			enqueue(&q, &procs[i]);
+		}
+	}
+
+	long ops = 0;
+	int batch = n < 1000 ? 1000 : n / 100;
+	double begin = now();
+	double secs;
+	do {
+		for (i = 0; i < batch; i++) {
+			if (kind == 2) {
+				scan_enqueue(&s, scan_dequeue(&s));
+			}else{
+				enqueue(&q, dequeue(&q));
+			}
+		}
+		ops += 2 * batch;
+		secs = now() - begin;
+	} while (secs < MIN_SECS);
+
+	free(q.heap);
+	free(s.proc);
+	return ops / secs / 1e6;
+}
+
+int main(void) {
+	int sizes[] = {10, 1000, 100000};
+	int k;
+	printf("%8s %14s %14s %14s\n", "queued", "heap", "prio array",
+		"array scan");
+	for (k = 0; k < 3; k++) {
+		int n = sizes[k];
+		struct pcb_t * procs = (struct pcb_t *)calloc(n,
+			sizeof(struct pcb_t));
+		int i;
+		srand(k);
+		for (i = 0; i < n; i++) {
+			procs[i].pid = i;
+			procs[i].priority = rand() % MAX_PRIO;
+		}
+		printf("%8d", n);
+		int kind;
+		for (kind = 0; kind < 3; kind++) {
+			printf(" %8.3f Mop/s", bench(kind, procs, n));
+		}
+		printf("\n");
+		free(procs);
+	}
+	return 0;
+}
@@ -0,0 +1,138 @@
+
+#include "queue.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Stress the lock-free ring with N producers and N consumers, check that
+ * every process comes out exactly once, and compare its throughput with a
+ * queue_t under one mutex. Both sides yield when the queue is full or
+ * empty.
+ *
+ * Usage: ring_bench [PROCS_PER_PRODUCER] */
+
+#define RING_SIZE	1024	// Same as the round-robin ring of the scheduler
+#define MAX_THREADS	16
+
+static long per_producer = 200000;
+
+static int use_mutex;
+static int nr_producers;
+static struct ring_t ring;
+static struct queue_t queue;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct pcb_t * procs;
+static int * received;	// Times each process has been dequeued
+static long nr_received;
+static unsigned long ring_retries;	// Lost races of the last ring run
+
+static void * producer(void * args) {
+	long id = (long)args;
+	long i;
+	for (i = 0; i < per_producer; i++) {
+		struct pcb_t * proc = &procs[id * per_producer + i];
+		if (use_mutex) {
+			pthread_mutex_lock(&queue_lock);
+			enqueue(&queue, proc);
+			pthread_mutex_unlock(&queue_lock);
+		}else{
+			while (ring_enqueue(&ring, proc)) {
+				sched_yield();
+			}
+		}
+	}
+	return NULL;
+}
+
+static void * consumer(void * args) {
+	long total = nr_producers * per_producer;
+	while (__atomic_load_n(&nr_received, __ATOMIC_RELAXED) < total) {
+		struct pcb_t * proc;
+		if (use_mutex) {
+			pthread_mutex_lock(&queue_lock);
+			proc = dequeue(&queue);
+			pthread_mutex_unlock(&queue_lock);
+		}else{
+			proc = ring_dequeue(&ring);
+		}
+		if (proc == NULL) {
+			sched_yield();
+			continue;
+		}
+		__atomic_add_fetch(&received[proc->pid], 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&nr_received, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/* Run [n] producers against [n] consumers, return million processes
+ * passed per second */
+static double run(int n, int mutex) {
+	long total = n * per_producer;
+	long i;
+	use_mutex = mutex;
+	nr_producers = n;
+	nr_received = 0;
+	for (i = 0; i < total; i++) {
+		procs[i].pid = i;
+		received[i] = 0;
+	}
+	init_ring(&ring, RING_SIZE);
+	memset(&queue, 0, sizeof(queue));
+
+	pthread_t threads[2 * MAX_THREADS];
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < n; i++) {
+		pthread_create(&threads[i], NULL, producer, (void *)i);
+		pthread_create(&threads[n + i], NULL, consumer, NULL);
+	}
+	for (i = 0; i < 2 * n; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < total; i++) {
+		if (received[i] != 1) {
+			printf("%s %dp/%dc: process %ld received %d times\n",
+				mutex ? "mutex" : "ring", n, n, i, received[i]);
+			exit(1);
+		}
+	}
+	if (!mutex) {
+		ring_retries = ring.retries;
+	}
+	free_ring(&ring);
+	free(queue.heap);
+	return total / ((end.tv_sec - begin.tv_sec) +
+		(end.tv_nsec - begin.tv_nsec) / 1e9) / 1e6;
+}
+
+int main(int argc, char ** argv) {
+	if (argc > 1) {
+		per_producer = atol(argv[1]);
+	}
+	if (per_producer <= 0) {
+		printf("Invalid number of processes per producer\n");
+		exit(1);
+	}
+	procs = (struct pcb_t *)calloc(MAX_THREADS * per_producer,
+		sizeof(struct pcb_t));
+	received = (int *)calloc(MAX_THREADS * per_producer, sizeof(int));
+
+	int n;
+	for (n = 1; n <= MAX_THREADS; n *= 4) {
+		double ring_rate = run(n, 0);
+		double mutex_rate = run(n, 1);
+		printf("%2dp/%2dc ring %5.1f Mops/s (%lu retries), "
+			"mutex %5.1f Mops/s\n",
+			n, n, ring_rate, ring_retries, mutex_rate);
+	}
+	free(received);
+	free(procs);
+	return 0;
+}
@@ -2,57 +2,335 @@
 #include "queue.h"
 #include "sched.h"
 #include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 
-static struct queue_t ready_queue;
-static struct queue_t run_queue;
-static pthread_mutex_t queue_lock;
+/* A ready/run queue pair. With POLICY_PERCPU each CPU owns one and idle
+ * CPUs steal from the busiest peer, otherwise every CPU shares rq[0]. */
+struct rq_t {
+	/* Double-buffered: a round ends by swapping the two pointers */
+	struct queue_t queues[2];
+	struct queue_t * ready_queue;
+	struct queue_t * run_queue;
+	pthread_mutex_t queue_lock;
+	int nr_queued;	// Processes in both queues, read without the lock
+	/* Statistics, updated with [queue_lock] held */
+	unsigned long nr_locks;		// Acquisitions of [queue_lock]
+	unsigned long nr_contended;	// Acquisitions which had to wait
+	unsigned long nr_steals;	// Successful steals by this CPU
+	unsigned long nr_stolen;	// Processes this CPU stole
+};
+
+/* Dispatch statistics of a CPU, only touched by the CPU itself */
+struct cpu_stat_t {
+	unsigned long nr_first;		// Processes which had never run
+	unsigned long nr_warm;		// Processes which last ran on this CPU
+	unsigned long nr_migrated;	// Processes which last ran elsewhere
+};
+
+static struct rq_t * rq;
+static int nr_rq;
+static int sched_policy;
+static int next_cpu;	// Where add_proc starts looking for the idlest CPU
+static struct cpu_stat_t * cpu_stat;
+static int nr_cpus;
+
+/* With POLICY_AFFINE a CPU looks this far down the processes sharing the
+ * highest priority for one it has run before. A process passed over stays
+ * at the head of the ready queue and the round only ends once the ready
+ * queue is empty, so nobody waits for more than one round. */
+#define AFFINITY_WINDOW	4
+
+/* With POLICY_RR every CPU shares one lock-free ring. The rare processes
+ * which do not fit in it wait in a FIFO list under rq[0]'s lock. */
+#define RR_RING_SIZE	1024
+
+static struct ring_t rr_ring;
+static struct pcb_t * overflow_head;
+static struct pcb_t * overflow_tail;
+static int nr_overflow;
+static unsigned long nr_overflowed;	// Processes which did not fit in the ring
+
+static void lock_rq(struct rq_t * q) {
+	int contended = 0;
+	if (pthread_mutex_trylock(&q->queue_lock) != 0) {
+		pthread_mutex_lock(&q->queue_lock);
+		contended = 1;
+	}
+	q->nr_locks++;
+	q->nr_contended += contended;
+}
+
+static void unlock_rq(struct rq_t * q) {
+	pthread_mutex_unlock(&q->queue_lock);
+}
+
+static int nr_queued(struct rq_t * q) {
+	return __atomic_load_n(&q->nr_queued, __ATOMIC_RELAXED);
+}
+
+static void add_queued(struct rq_t * q, int n) {
+	__atomic_store_n(&q->nr_queued, q->nr_queued + n, __ATOMIC_RELAXED);
+}
+
+static struct rq_t * cpu_rq(int cpu) {
+	return (sched_policy & POLICY_PERCPU) ? &rq[cpu] : &rq[0];
+}
+
+/* Get the highest priority process from [q] for CPU [cpu] (-1 for any),
+ * starting a new round from its run queue if the ready queue is empty.
+ * Caller holds the lock. */
+static struct pcb_t * pick_proc(struct rq_t * q, int cpu) {
+	if (empty(q->ready_queue)) {
+		struct queue_t * tmp = q->ready_queue;
+		q->ready_queue = q->run_queue;
+		q->run_queue = tmp;
+	}
+	struct pcb_t * proc;
+	if ((sched_policy & POLICY_AFFINE) && cpu >= 0) {
+		proc = dequeue_affine(q->ready_queue, cpu, AFFINITY_WINDOW);
+	}else{
+		proc = dequeue(q->ready_queue);
+	}
+	if (proc != NULL) {
+		add_queued(q, -1);
+	}
+	return proc;
+}
+
+/* Take half of the processes queued on the busiest CPU other than [cpu].
+ * One of them is returned, the rest go to the ready queue of [cpu]. */
+static struct pcb_t * steal_proc(int cpu) {
+	struct rq_t * victim = NULL;
+	int busiest = 0;
+	int i;
+	for (i = 0; i < nr_rq; i++) {
+		if (i != cpu && nr_queued(&rq[i]) > busiest) {
+			busiest = nr_queued(&rq[i]);
+			victim = &rq[i];
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	/* Never hold two queue locks at once */
+	lock_rq(victim);
+	int n = (victim->nr_queued + 1) / 2;
+	struct pcb_t ** stolen = (struct pcb_t **)malloc(
+		sizeof(struct pcb_t *) * (n > 0 ? n : 1));
+	int got = 0;
+	while (got < n) {
+		stolen[got] = pick_proc(victim, -1);
+		if (stolen[got] == NULL) break;
+		got++;
+	}
+	unlock_rq(victim);
+
+	struct rq_t * q = &rq[cpu];
+	lock_rq(q);
+	if (got > 0) {
+		q->nr_steals++;
+		q->nr_stolen += got;
+	}
+	for (i = 1; i < got; i++) {
+		enqueue(q->ready_queue, stolen[i]);
+		add_queued(q, 1);
+	}
+	unlock_rq(q);
+
+	struct pcb_t * proc = got > 0 ? stolen[0] : NULL;
+	free(stolen);
+	return proc;
+}
+
+static void rr_put(struct pcb_t * proc) {
+	if (ring_enqueue(&rr_ring, proc) == 0) {
+		return;
+	}
+	lock_rq(&rq[0]);
+	proc->next = NULL;
+	if (overflow_tail == NULL) {
+		overflow_head = proc;
+	}else{
+		overflow_tail->next = proc;
+	}
+	overflow_tail = proc;
+	nr_overflowed++;
+	__atomic_store_n(&nr_overflow, nr_overflow + 1, __ATOMIC_RELEASE);
+	unlock_rq(&rq[0]);
+}
+
+static struct pcb_t * rr_get(void) {
+	struct pcb_t * proc = ring_dequeue(&rr_ring);
+	if (proc != NULL || __atomic_load_n(&nr_overflow, __ATOMIC_ACQUIRE) == 0) {
+		return proc;
+	}
+	lock_rq(&rq[0]);
+	proc = overflow_head;
+	if (proc != NULL) {
+		overflow_head = proc->next;
+		if (overflow_head == NULL) {
+			overflow_tail = NULL;
+		}
+		proc->next = NULL;
+		__atomic_store_n(&nr_overflow, nr_overflow - 1, __ATOMIC_RELEASE);
+	}
+	unlock_rq(&rq[0]);
+	return proc;
+}
 
 int queue_empty(void) {
-	return (empty(&ready_queue) && empty(&run_queue));
+	if (sched_policy & POLICY_RR) {
+		return __atomic_load_n(&rr_ring.head, __ATOMIC_ACQUIRE) ==
+			__atomic_load_n(&rr_ring.tail, __ATOMIC_ACQUIRE) &&
+			__atomic_load_n(&nr_overflow, __ATOMIC_ACQUIRE) == 0;
+	}
+	int i;
+	for (i = 0; i < nr_rq; i++) {
+		if (!empty(rq[i].ready_queue) || !empty(rq[i].run_queue)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void init_scheduler(int policy, int num_cpus) {
+	if (policy & POLICY_RR) {
+		policy = POLICY_RR;
+		init_ring(&rr_ring, RR_RING_SIZE);
+		overflow_head = overflow_tail = NULL;
+		nr_overflow = 0;
+		nr_overflowed = 0;
+	}
+	sched_policy = policy;
+	nr_cpus = num_cpus;
+	cpu_stat = (struct cpu_stat_t *)calloc(num_cpus,
+		sizeof(struct cpu_stat_t));
+	nr_rq = (policy & POLICY_PERCPU) ? num_cpus : 1;
+	rq = (struct rq_t *)calloc(nr_rq, sizeof(struct rq_t));
+	int i;
+	for (i = 0; i < nr_rq; i++) {
+		if (policy & POLICY_O1) {
+			init_prio_array(&rq[i].queues[0]);
+			init_prio_array(&rq[i].queues[1]);
+		}
+		rq[i].ready_queue = &rq[i].queues[0];
+		rq[i].run_queue = &rq[i].queues[1];
+		pthread_mutex_init(&rq[i].queue_lock, NULL);
+	}
+	next_cpu = 0;
 }
 
-void init_scheduler(void) {
-	ready_queue.size = 0;
-	run_queue.size = 0;
-	pthread_mutex_init(&queue_lock, NULL);
+void finish_scheduler(void) {
+	int i;
+	for (i = 0; i < nr_rq; i++) {
+		free(rq[i].queues[0].heap);
+		free(rq[i].queues[1].heap);
+		pthread_mutex_destroy(&rq[i].queue_lock);
+	}
+	free(rq);
+	rq = NULL;
+	nr_rq = 0;
+	free(cpu_stat);
+	cpu_stat = NULL;
+	if (sched_policy & POLICY_RR) {
+		free_ring(&rr_ring);
+	}
 }
 
-struct pcb_t * get_proc(void) {
+struct pcb_t * get_proc(int cpu) {
 	struct pcb_t * proc = NULL;
 	//TODO: get a process from [ready_queue]. If ready queue
 	 //is empty, push all processes in [run_queue] back to
 	 //[ready_queue] and return the highest priority one.
 	 //Remember to use lock to protect the queue.
-	
-	//process ready queue empty
-	if (empty(&ready_queue))
-	{
-		for (int i = 0; i < run_queue.size; i++)
-		{
-			add_proc(run_queue.proc[i]);
-			run_queue.proc[i] = NULL;
+	if (sched_policy & POLICY_RR) {
+		proc = rr_get();
+	}else{
+		struct rq_t * q = cpu_rq(cpu);
+		lock_rq(q);
+		proc = pick_proc(q, cpu);
+		unlock_rq(q);
+
+		if (proc == NULL && (sched_policy & POLICY_PERCPU)) {
+			proc = steal_proc(cpu);
 		}
-		run_queue.size = 0;
 	}
 
-	//get highest priority proc from ready queue
-	pthread_mutex_lock(&queue_lock);
-	proc = dequeue(&ready_queue);
-	pthread_mutex_unlock(&queue_lock);
-	
+	if (proc != NULL) {
+		if (proc->cpu < 0) {
+			cpu_stat[cpu].nr_first++;
+		}else if (proc->cpu == cpu) {
+			cpu_stat[cpu].nr_warm++;
+		}else{
+			cpu_stat[cpu].nr_migrated++;
+		}
+		proc->cpu = cpu;
+	}
 	return proc;
 }
 
-void put_proc(struct pcb_t * proc) {
-	pthread_mutex_lock(&queue_lock);
-	enqueue(&run_queue, proc);
-	pthread_mutex_unlock(&queue_lock);
+void put_proc(struct pcb_t * proc, int cpu) {
+	if (sched_policy & POLICY_RR) {
+		rr_put(proc);
+		return;
+	}
+	struct rq_t * q = cpu_rq(cpu);
+	lock_rq(q);
+	enqueue(q->run_queue, proc);
+	add_queued(q, 1);
+	unlock_rq(q);
 }
 
 void add_proc(struct pcb_t * proc) {
-	pthread_mutex_lock(&queue_lock);
-	enqueue(&ready_queue, proc);
-	pthread_mutex_unlock(&queue_lock);
+	/* Spread new processes: pick the CPU with the fewest queued ones,
+	 * starting the search after the CPU chosen last time */
+	if (sched_policy & POLICY_RR) {
+		rr_put(proc);
+		return;
+	}
+	int cpu = 0;
+	if (sched_policy & POLICY_PERCPU) {
+		int start = __atomic_fetch_add(&next_cpu, 1, __ATOMIC_RELAXED);
+		int i;
+		cpu = start % nr_rq;
+		for (i = 1; i < nr_rq; i++) {
+			int c = (start + i) % nr_rq;
+			if (nr_queued(&rq[c]) < nr_queued(&rq[cpu])) {
+				cpu = c;
+			}
+		}
+	}
+	struct rq_t * q = &rq[cpu];
+	lock_rq(q);
+	enqueue(q->ready_queue, proc);
+	add_queued(q, 1);
+	unlock_rq(q);
 }
 
+void sched_stats(void) {
+	unsigned long locks = 0, contended = 0, steals = 0, stolen = 0;
+	unsigned long first = 0, warm = 0, migrated = 0;
+	int i;
+	for (i = 0; i < nr_rq; i++) {
+		locks += rq[i].nr_locks;
+		contended += rq[i].nr_contended;
+		steals += rq[i].nr_steals;
+		stolen += rq[i].nr_stolen;
+	}
+	for (i = 0; i < nr_cpus; i++) {
+		first += cpu_stat[i].nr_first;
+		warm += cpu_stat[i].nr_warm;
+		migrated += cpu_stat[i].nr_migrated;
+	}
+	printf("Queue locks: %lu (contended: %lu)\n", locks, contended);
+	printf("Steals: %lu, processes stolen: %lu\n", steals, stolen);
+	printf("Dispatches: %lu first runs, %lu on the same CPU, "
+		"%lu migrations\n", first, warm, migrated);
+	if (sched_policy & POLICY_RR) {
+		printf("Ring retries: %lu, overflowed: %lu\n",
+			rr_ring.retries, nr_overflowed);
+	}
+}
 
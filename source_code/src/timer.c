@@ -16,80 +16,123 @@ static uint64_t _time;
 
 static int timer_started = 0;
 static int timer_stop = 0;
+static int fast_forward = 0;
+
+/* All devices meet the timer at a single barrier. [_time] doubles as the
+ * generation counter of the barrier: a device that has done its job waits
+ * until [_time] moves past the slot it arrived in, so advancing a slot is
+ * one broadcast no matter how many devices are attached. */
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER; // Device -> timer
+static pthread_cond_t slot_cond = PTHREAD_COND_INITIALIZER;  // Timer -> devices
+
+static int nr_devs = 0;	// Number of attached devices
+static int nr_done = 0;	// Devices waiting for the next slot
+static int nr_fsh = 0;	// Devices which have been detached
+static int nr_idle = 0;	// Devices waiting in idle_slot()
+static uint64_t wake_min = IDLE_FOREVER; // Earliest wake-up of idle devices
+
+void begin_slot(void) {
+	printf("Time slot %3lu\n", current_time());
+}
 
+void end_slot(uint64_t next) {
+	/* Slots skipped on the way are announced too, so the output does
+	 * not depend on whether they were actually simulated */
+	while (_time + 1 < next) {
+		_time++;
+		begin_slot();
+	}
+	_time++;
+}
 
 static void * timer_routine(void * args) {
 	while (!timer_stop) {
-		printf("Time slot %3lu\n", current_time());
-		int fsh = 0;
-		int event = 0;
+		begin_slot();
 		/* Wait for all devices have done the job in current
 		 * time slot */
-		struct timer_id_container_t * temp;
-		for (temp = dev_list; temp != NULL; temp = temp->next) {
-			pthread_mutex_lock(&temp->id.event_lock);
-			while (!temp->id.done && !temp->id.fsh) {
-				pthread_cond_wait(
-					&temp->id.event_cond,
-					&temp->id.event_lock
-				);
-			}
-			if (temp->id.fsh) {
-				fsh++;
-			}
-			event++;
-			pthread_mutex_unlock(&temp->id.event_lock);
+		pthread_mutex_lock(&timer_lock);
+		while (nr_done + nr_fsh < nr_devs) {
+			pthread_cond_wait(&event_cond, &timer_lock);
 		}
-
-		/* Increase the time slot */
-		_time++;
-		
-		/* Let devices continue their job */
-		for (temp = dev_list; temp != NULL; temp = temp->next) {
-			pthread_mutex_lock(&temp->id.timer_lock);
-			temp->id.done = 0;
-			pthread_cond_signal(&temp->id.timer_cond);
-			pthread_mutex_unlock(&temp->id.timer_lock);
+		int fsh = (nr_fsh == nr_devs);
+
+		/* If nobody did anything in this slot, nothing can happen
+		 * before the earliest wake-up either. Skip straight to it. */
+		uint64_t next = _time + 1;
+		if (fast_forward && nr_idle == nr_done &&
+				wake_min != IDLE_FOREVER && wake_min > next) {
+			next = wake_min;
 		}
-		if (fsh == event) {
+
+		/* Increase the time slot and let devices continue
+		 * their job */
+		end_slot(next);
+		nr_done = 0;
+		nr_idle = 0;
+		wake_min = IDLE_FOREVER;
+		pthread_cond_broadcast(&slot_cond);
+		pthread_mutex_unlock(&timer_lock);
+		if (fsh) {
 			break;
 		}
 	}
 	pthread_exit(args);
 }
 
-void next_slot(struct timer_id_t * timer_id) {
+static void wait_slot(struct timer_id_t * timer_id) {
 	// Tell to timer that we have done our job in current slot
-	pthread_mutex_lock(&timer_id->event_lock);
+	uint64_t slot = _time;
 	timer_id->done = 1;
-	pthread_cond_signal(&timer_id->event_cond);
-	pthread_mutex_unlock(&timer_id->event_lock);
+	nr_done++;
+	if (nr_done + nr_fsh == nr_devs) {
+		pthread_cond_signal(&event_cond);
+	}
 
 	// Wait for going to next slot
-	pthread_mutex_lock(&timer_id->timer_lock);
-	while (timer_id->done) {
-		pthread_cond_wait(
-			&timer_id->timer_cond,
-			&timer_id->timer_lock
-		);
+	while (_time == slot) {
+		pthread_cond_wait(&slot_cond, &timer_lock);
+	}
+	timer_id->done = 0;
+}
+
+void next_slot(struct timer_id_t * timer_id) {
+	pthread_mutex_lock(&timer_lock);
+	wait_slot(timer_id);
+	pthread_mutex_unlock(&timer_lock);
+}
+
+void idle_slot(struct timer_id_t * timer_id, uint64_t wake) {
+	pthread_mutex_lock(&timer_lock);
+	nr_idle++;
+	if (wake < wake_min) {
+		wake_min = wake;
 	}
-	pthread_mutex_unlock(&timer_id->timer_lock);
+	wait_slot(timer_id);
+	pthread_mutex_unlock(&timer_lock);
 }
 
 uint64_t current_time() {
 	return _time;
 }
 
+void set_fast_forward(int enable) {
+	fast_forward = enable;
+}
+
 void start_timer() {
 	timer_started = 1;
 	pthread_create(&_timer, NULL, timer_routine, NULL);
 }
 
 void detach_event(struct timer_id_t * event) {
-	pthread_mutex_lock(&event->event_lock);
+	pthread_mutex_lock(&timer_lock);
 	event->fsh = 1;
-	pthread_cond_signal(&event->event_cond);
-	pthread_mutex_unlock(&event->event_lock);
+	nr_fsh++;
+	if (nr_done + nr_fsh == nr_devs) {
+		pthread_cond_signal(&event_cond);
+	}
+	pthread_mutex_unlock(&timer_lock);
 }
 
 struct timer_id_t * attach_event() {
@@ -102,17 +145,9 @@ struct timer_id_t * attach_event() {
 			);
 		container->id.done = 0;
 		container->id.fsh = 0;
-		pthread_cond_init(&container->id.event_cond, NULL);
-		pthread_mutex_init(&container->id.event_lock, NULL);
-		pthread_cond_init(&container->id.timer_cond, NULL);
-		pthread_mutex_init(&container->id.timer_lock, NULL);
-		if (dev_list == NULL) {
-			dev_list = container;
-			dev_list->next = NULL;
-		}else{
-			container->next = dev_list;
-			dev_list = container;
-		}
+		container->next = dev_list;
+		dev_list = container;
+		nr_devs++;
 		return &(container->id);
 	}
 }
@@ -123,14 +158,7 @@ void stop_timer() {
 	while (dev_list != NULL) {
 		struct timer_id_container_t * temp = dev_list;
 		dev_list = dev_list->next;
-		pthread_cond_destroy(&temp->id.event_cond);
-		pthread_mutex_destroy(&temp->id.event_lock);
-		pthread_cond_destroy(&temp->id.timer_cond);
-		pthread_mutex_destroy(&temp->id.timer_lock);
 		free(temp);
 	}
 }
 
-
-
-
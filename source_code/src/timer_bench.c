@@ -0,0 +1,67 @@
+
+#include "timer.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Run N devices through the timer barrier and report how many slots per
+ * second it moves. Devices do no work, so this is the cost of the barrier
+ * alone. The timer announces every slot on stdout, results go to stderr.
+ *
+ * Usage: timer_bench NUM_DEVICES [NUM_SLOTS] */
+
+static int num_slots = 2000;
+
+static void * device_routine(void * args) {
+	struct timer_id_t * timer_id = (struct timer_id_t *)args;
+	int i;
+	for (i = 0; i < num_slots; i++) {
+		next_slot(timer_id);
+	}
+	detach_event(timer_id);
+	pthread_exit(NULL);
+}
+
+int main(int argc, char ** argv) {
+	if (argc < 2) {
+		printf("Usage: timer_bench NUM_DEVICES [NUM_SLOTS]\n");
+		exit(1);
+	}
+	int num_devs = atoi(argv[1]);
+	if (argc > 2) {
+		num_slots = atoi(argv[2]);
+	}
+	if (num_devs <= 0 || num_slots <= 0) {
+		printf("Invalid number of devices or slots\n");
+		exit(1);
+	}
+
+	pthread_t * devs = (pthread_t *)malloc(num_devs * sizeof(pthread_t));
+	struct timer_id_t ** ids = (struct timer_id_t **)malloc(
+		num_devs * sizeof(struct timer_id_t *));
+	int i;
+	for (i = 0; i < num_devs; i++) {
+		ids[i] = attach_event();
+	}
+
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	start_timer();
+	for (i = 0; i < num_devs; i++) {
+		pthread_create(&devs[i], NULL, device_routine, ids[i]);
+	}
+	for (i = 0; i < num_devs; i++) {
+		pthread_join(devs[i], NULL);
+	}
+	stop_timer();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - begin.tv_sec) +
+		(end.tv_nsec - begin.tv_nsec) / 1e9;
+	fprintf(stderr, "%4d devices: %9.0f slots/s\n",
+		num_devs, num_slots / secs);
+	free(ids);
+	free(devs);
+	return 0;
+}
@@ -0,0 +1,185 @@
+
+#include "mem.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Cost of translating random addresses of one process holding 30 regions
+ * of 30 pages. The tables are walked the way they used to be, searching
+ * rows tagged with their virtual index, and the way they are now, indexed
+ * directly. read_mem() is timed too, with random addresses which mostly
+ * miss the TLB and with one address which always hits it. */
+
+#define NUM_REGIONS	30
+#define REGION_PAGES	30
+#define NUM_ADDRS	(1 << 16)
+#define ROUNDS		100
+
+/* Segment and page tables of old, searched linearly */
+struct old_page_table_t {
+	struct {
+		addr_t v_index;
+		addr_t p_index;
+	} * table;
+	int size;
+};
+
+struct old_seg_table_t {
+	struct {
+		addr_t v_index;
+		struct old_page_table_t * pages;
+	} * table;
+	int size;
+};
+
+static struct old_seg_table_t old_tables;
+
+static volatile addr_t sink;	// Keeps the walks from being optimized out
+
+/* Copy the mapping of [proc] to [old_tables], one row per mapped page */
+static void build_old_tables(struct pcb_t * proc) {
+	int rows = 1 << SEGMENT_LEN;
+	old_tables.table = calloc(rows, sizeof(old_tables.table[0]));
+	old_tables.size = 0;
+	int seg;
+	for (seg = 0; seg < rows; seg++) {
+		struct seg_entry_t * entry = &proc->seg_table->table[seg];
+		if (!entry->large && entry->pages == NULL) continue;
+		struct old_page_table_t * pages = malloc(sizeof(*pages));
+		pages->table = calloc(1 << PAGE_LEN, sizeof(pages->table[0]));
+		pages->size = 0;
+		int page;
+		for (page = 0; page < (1 << PAGE_LEN); page++) {
+			if (entry->large) {
+				pages->table[pages->size].p_index =
+					entry->p_index + page;
+			}else if (entry->pages->table[page].valid) {
+				pages->table[pages->size].p_index =
+					entry->pages->table[page].p_index;
+			}else{
+				continue;
+			}
+			pages->table[pages->size++].v_index = page;
+		}
+		old_tables.table[old_tables.size].v_index = seg;
+		old_tables.table[old_tables.size++].pages = pages;
+	}
+}
+
+static addr_t old_translate(addr_t addr) {
+	addr_t seg = addr >> (OFFSET_LEN + PAGE_LEN);
+	addr_t page = (addr >> OFFSET_LEN) & ((1 << PAGE_LEN) - 1);
+	int i;
+	for (i = 0; i < old_tables.size; i++) {
+		if (old_tables.table[i].v_index != seg) continue;
+		struct old_page_table_t * pages = old_tables.table[i].pages;
+		int j;
+		for (j = 0; j < pages->size; j++) {
+			if (pages->table[j].v_index == page) {
+				return (pages->table[j].p_index << OFFSET_LEN) |
+					(addr & (PAGE_SIZE - 1));
+			}
+		}
+	}
+	return 0;
+}
+
+static addr_t new_translate(addr_t addr, struct pcb_t * proc) {
+	addr_t seg = addr >> (OFFSET_LEN + PAGE_LEN);
+	addr_t page = (addr >> OFFSET_LEN) & ((1 << PAGE_LEN) - 1);
+	struct seg_entry_t * entry = &proc->seg_table->table[seg];
+	addr_t p_index;
+	if (entry->large) {
+		p_index = entry->p_index + page;
+	}else{
+		p_index = entry->pages->table[page].p_index;
+	}
+	return (p_index << OFFSET_LEN) | (addr & (PAGE_SIZE - 1));
+}
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(void) {
+	init_mem(0);
+	init_tlb(1);
+	struct pcb_t proc = {0};
+	proc.pid = 1;
+	proc.cpu = 0;
+	proc.bp = PAGE_SIZE;
+	proc.arena = new_arena();
+	proc.seg_table = arena_alloc(proc.arena, SEG_TABLE_SIZE);
+
+	addr_t regions[NUM_REGIONS];
+	int i;
+	for (i = 0; i < NUM_REGIONS; i++) {
+		regions[i] = alloc_mem(REGION_PAGES * PAGE_SIZE, &proc);
+		if (regions[i] == 0) {
+			printf("Cannot allocate region %d\n", i);
+			exit(1);
+		}
+	}
+	build_old_tables(&proc);
+
+	addr_t * addrs = malloc(NUM_ADDRS * sizeof(addr_t));
+	srand(1);
+	for (i = 0; i < NUM_ADDRS; i++) {
+		addrs[i] = regions[rand() % NUM_REGIONS] +
+			rand() % (REGION_PAGES * PAGE_SIZE);
+		if (old_translate(addrs[i]) != new_translate(addrs[i], &proc)) {
+			printf("Tables disagree on %05x\n", addrs[i]);
+			exit(1);
+		}
+	}
+
+	long n = (long)ROUNDS * NUM_ADDRS;
+	addr_t sum = 0;
+	BYTE data;
+	int r;
+	double begin = now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < NUM_ADDRS; i++) {
+			sum += old_translate(addrs[i]);
+		}
+	}
+	double old_ns = (now() - begin) * 1e9 / n;
+
+	begin = now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < NUM_ADDRS; i++) {
+			sum += new_translate(addrs[i], &proc);
+		}
+	}
+	double new_ns = (now() - begin) * 1e9 / n;
+
+	begin = now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < NUM_ADDRS; i++) {
+			read_mem(addrs[i], &proc, &data);
+		}
+	}
+	double miss_ns = (now() - begin) * 1e9 / n;
+
+	begin = now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < NUM_ADDRS; i++) {
+			read_mem(addrs[0], &proc, &data);
+		}
+	}
+	double hit_ns = (now() - begin) * 1e9 / n;
+
+	printf("Linear search of tagged rows: %6.1f ns per translation\n",
+		old_ns);
+	printf("Direct index:                 %6.1f ns per translation\n",
+		new_ns);
+	printf("read_mem, random addresses:   %6.1f ns per read\n", miss_ns);
+	printf("read_mem, same address:       %6.1f ns per read\n", hit_ns);
+	sink = sum;
+	free(addrs);
+	release_mem(&proc);
+	return 0;
+}